@@ -2,6 +2,12 @@
 
 layout(location = 0) out vec4 FragColor;
 
-in vec3 PointColor;
+in vec2 TexCoords;
 
-void main() { FragColor = vec4(PointColor, 1); }
\ No newline at end of file
+uniform sampler2D tex;
+
+// the frame only fills part of the texture when the dynamic resolution lowers the column count
+uniform vec2 uvScale = vec2(1, 1);
+uniform vec2 uvMax = vec2(1, 1);
+
+void main() { FragColor = vec4(texture(tex, min(TexCoords * uvScale, uvMax)).rgb, 1); }
\ No newline at end of file
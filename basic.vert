@@ -1,14 +1,12 @@
 #version 330 core
 
 layout(location = 0) in vec2 position;
-layout(location = 1) in vec3 color;
+layout(location = 1) in vec2 texCoords;
 
-out vec3 PointColor;
-
-uniform mat4 projection;
+out vec2 TexCoords;
 
 void main()
 {
-    PointColor = color; 
-    gl_Position = projection * vec4(position, -1, 1);
+    TexCoords = texCoords;
+    gl_Position = vec4(position, 0, 1);
 }
\ No newline at end of file
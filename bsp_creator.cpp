@@ -9,12 +9,20 @@
 #include "stb_ds.h"
 
 #include <cstdint>
+#include <atomic>
+#include <thread>
+#include <mutex>
 
 struct vec2
 {
     float x = 0, y = 0;
 };
 
+struct vec3
+{
+    float x = 0, y = 0, z = 0;
+};
+
 struct BSPNode;
 
 struct BSPChildren
@@ -25,8 +33,9 @@ struct BSPChildren
 
 struct BSPLines
 {
-    uint16_t numIndices = 0;
+    uint32_t numIndices = 0;
     uint32_t* verticesIndecies = nullptr;
+    uint32_t* sources = nullptr; // per line, the input line it was cut from
 };
 
 union BSPData {
@@ -34,31 +43,294 @@ union BSPData {
     BSPLines* lines;
 };
 
+struct BSPBounds
+{
+    vec2 min;
+    vec2 max;
+};
+
+// start of the compiled map, followed by the section table, the checksum covers everything after the header
+struct BSPFileHeader
+{
+    char magic[4];
+    uint32_t version;
+    uint32_t numSections;
+    uint32_t checksum;
+};
+
+// every section starts at a BSP_FILE_ALIGNMENT aligned offset, so the renderer can map the file and use
+// the data in place, readers skip the sections they don't know about
+struct BSPFileSection
+{
+    uint32_t type;
+    uint32_t count;
+    uint32_t offset;
+    uint32_t size;
+};
+
+enum BSPSectionType
+{
+    BSP_SECTION_VERTICES = 1, // vec2 per vertex
+    BSP_SECTION_NODES,        // BSPFileNode per node, breadth first, the root is node 0
+    BSP_SECTION_BOUNDS,       // BSPBounds per node
+    BSP_SECTION_LEAVES,       // BSPFileLeaf per leaf
+    BSP_SECTION_SEGMENTS,     // uint32_t vertex index pairs, the lines of all the leaves one after another
+    BSP_SECTION_COLORS,       // vec3 per leaf
+    BSP_SECTION_WALLS,        // BSPFileWall per line, in the same order as the segments section
+    BSP_SECTION_SPLITTERS,    // uint32_t vertex index pair per node, zeros for leaves, for incremental builds
+    BSP_SECTION_SOURCE_LINES, // vec2 pairs, the lines of the input map, for incremental builds
+    BSP_SECTION_LINE_SOURCES, // uint32_t per line of the segments section, its source line, for incremental builds
+    NUM_BSP_SECTION_TYPES,
+};
+
+// fixed size, so the renderer indexes the nodes directly, the back child of an inner node always directly
+// follows its front child, a point p is in front of the splitter when dot(normal, p) > distance
+struct BSPFileNode
+{
+    vec2 normal;       // unit normal of the splitter pointing to its front side, inner nodes only
+    float distance;    // of the splitter from the origin, along the normal
+    uint32_t children; // index of the front child for inner nodes, BSP_LEAF_NODE | leaf index for leaves
+};
+
+struct BSPFileLeaf
+{
+    uint32_t firstIndex; // into the segments section, the leaf's first wall is firstIndex / 2
+    uint32_t numIndices;
+};
+
+// a leaf line with everything the renderer needs already worked out, so drawing it doesn't go through
+// the vertices, the line equation is the same as a splitter's
+struct BSPFileWall
+{
+    vec2 start;
+    vec2 direction; // end - start, not normalized
+    vec2 normal;
+    float distance;
+    float length;
+};
+
 struct BSPNode
 {
     bool isLeaf;
+    BSPBounds bounds;
     uint32_t splitter[2];
     BSPData data;
 };
 
+// intersections that land within weldEpsilon of an existing vertex reuse it, the vertices are hashed by the
+// weldEpsilon sized grid cell they're in, so only the 3x3 cells around a new point have to be searched,
+// every cell keeps the head of a list that continues through nextInCell
+struct WeldTable
+{
+    uint64_t* cellKeys = nullptr;
+    uint32_t* cellHeads = nullptr;
+    uint32_t numCells = 0;
+    uint32_t capacity = 0;
+    uint32_t* nextInCell = nullptr;
+};
+
+// the vertices live in chunks of VERTEX_CHUNK_SIZE that never move, so a split can add vertices while
+// pointers to the old ones are still in use, on its own thread or any other, the chunk table has a fixed size
 struct Map
 {
     uint32_t numVertices;
     uint32_t numOfIndices;
-    uint32_t maxVertices;
+    uint32_t numVertexChunks;
+    vec2** vertexChunks;
+    std::mutex verticesMutex;
+    WeldTable weldTable;
+};
+
+// linear allocator made of blocks that never move, only the last allocation can still grow in place
+struct ArenaBlock
+{
+    uint8_t* memory;
+    size_t size;
+};
+
+struct Arena
+{
+    ArenaBlock* blocks = nullptr;
+    uint32_t currentBlock = 0;
+    size_t used = 0;
+};
+
+// a splitter's score is splitWeight * <lines it cuts> + balanceWeight * |<lines in front> - <lines behind>|
+// the lowest score wins, numCandidates > 0 scores only that many randomly picked lines per node, nodes with
+// fewer lines score all of them, 0 scores all of them everywhere, which costs lines^2 per node on big maps,
+// exactPredicates classifies the points with exact orientation tests, treats the ones within snapDistance of
+// a splitter as lying on it and cuts lines without going through their slopes, snapDistance is relative to the
+// splitter's length, when it isn't given it's weldEpsilon, as a cut can be welded that far from the splitter,
+// 0 keeps the tests exact
+struct BuildOptions
+{
+    float splitWeight = 8.f;
+    float balanceWeight = 1.f;
+    uint32_t numCandidates = 32;
+    uint32_t numThreads = 1;
+    uint32_t minTaskLines = 256;
+    float weldEpsilon = 0.001f;
+    bool exactPredicates = false;
+    float snapDistance = -1.f; // < 0 until it's given or set to weldEpsilon
+};
+
+// a task builds the subtree of one node, the worker that split a node keeps the back side for itself and
+// queues the front side when it has at least minTaskLines lines, idle workers steal from the other end of
+// the queues, so they take the biggest subtrees, while the owner keeps going depth first
+struct BuildTask
+{
+    BSPNode* node;
+    BSPLines lines;
+    uint32_t candidateSeed;
+};
+
+struct BuildQueue
+{
+    std::mutex mutex;
+    BuildTask* tasks = nullptr;
+    uint32_t firstTask = 0;
+};
+
+// each worker has three arenas that live until the tree is written out, the tree arena holds the nodes,
+// the line arena holds the index arrays that get partitioned in place, so the leaves just point into it,
+// the source arena holds the lines' sources, which are moved along with them, so it mirrors the line arena
+struct BuildPool
+{
+    Map* map;
+    uint32_t numWorkers;
+    BuildQueue* queues;
+    Arena* treeArenas;
+    Arena* lineArenas;
+    Arena* sourceArenas;
+    std::atomic<uint32_t> numPendingTasks;
+};
+
+struct BuildWorker
+{
+    BuildPool* pool;
+    uint32_t workerIdx;
+    Arena* treeArena;
+    Arena* lineArena;
+    Arena* sourceArena;
+    uint32_t* splitLines; // scratch for partitionSpace(), reused by every node the worker splits
+    uint32_t* backLines;
+    uint32_t* backHalves;
+    uint32_t* splitSources;
+    uint32_t* backSources;
+};
+
+// an input line and where it is in its list, sorted by the points alone to find the lines two inputs share
+struct SourceLine
+{
+    vec2 points[2];
+    uint32_t index;
+};
+
+// a compiled map read back for an incremental build, the tree is taken over from it
+struct PreviousMap
+{
+    uint8_t* data;
+    size_t size;
+    BSPFileSection* sections[NUM_BSP_SECTION_TYPES];
     vec2* vertices;
+    BSPFileNode* nodes;
+    BSPFileLeaf* leaves;
+    uint32_t* segments;
+    uint32_t* splitters;
+    vec2* sourceLines;
+    uint32_t* lineSources;
+    uint32_t numVertices;
+    uint32_t numNodes;
+    uint32_t numLeaves;
+    uint32_t numSegmentIndices;
+    uint32_t numSourceIndices;
 };
 
-static char manual[] = "Usage: bsp <input-map-file> <output-map-file>";
+enum LineSide
+{
+    LINE_FRONT,
+    LINE_BACK,
+    LINE_SPLIT,
+};
 
-BSPNode* partitionSpace(Map* map, BSPLines* lines);
-uint16_t pickSplitter(Map* map, BSPLines* lines);
+static const size_t ARENA_BLOCK_SIZE = 1024 * 1024;
+static const size_t ARENA_ALIGNMENT = 8;
+static const uint32_t VERTEX_CHUNK_SHIFT = 12;
+static const uint32_t VERTEX_CHUNK_SIZE = 1 << VERTEX_CHUNK_SHIFT;
+static const uint32_t MAX_VERTEX_CHUNKS = 1 << 16;
+static const uint64_t EMPTY_WELD_CELL = ~0ull;
+static const uint32_t NO_VERTEX = ~0u;
+static const char BSP_FILE_MAGIC[4] = { 'B', 'S', 'P', 'M' };
+static const uint32_t BSP_FILE_VERSION = 4;
+static const uint32_t BSP_FILE_ALIGNMENT = 16;
+static const uint32_t BSP_LEAF_NODE = 1u << 31;
+static const double ORIENT_ERROR_BOUND = (3.0 + 16.0 * DBL_EPSILON / 2.0) * DBL_EPSILON / 2.0;
+static const uint32_t MAX_ORIENT_TERMS = 16;
+static const uint32_t NUM_LEAF_TEST_SAMPLES = 8;
+static const uint64_t FNV_OFFSET_BASIS = 0xcbf29ce484222325ull;
+static const uint64_t FNV_PRIME = 0x100000001b3ull;
+static const size_t MAX_CACHE_PATH = 4096;
+static const uint32_t NO_SOURCE = ~0u;
+
+static BuildOptions buildOptions;
+
+static char manual[] = "Usage: bsp <input-map-file> <output-map-file> [--split-weight <weight>] "
+                       "[--balance-weight <weight>] [--candidates <num-candidates>] [--threads <num-threads>] "
+                       "[--task-lines <min-lines-per-task>] [--weld-epsilon <distance>] [--exact] "
+                       "[--snap-distance <distance>] [--incremental <previous-output-map-file>] "
+                       "[--cache <cache-directory>]";
+
+BSPNode* buildTree(Map* map, BSPLines* lines, uint32_t numThreads);
+void buildNodes(Map* map, BSPNode** nodes, BSPLines* lines, uint32_t numNodes, uint32_t numThreads);
+BSPNode* rebuildTree(Map* map, vec2* sourceLines, uint32_t numSourceIndices, const char* previousMapPath,
+                     uint32_t numThreads);
+bool readPreviousMap(PreviousMap* previous, const char* previousMapPath);
+void* previousSection(PreviousMap* previous, uint32_t type, uint32_t elementSize, uint32_t* count);
+BSPNode* importNode(PreviousMap* previous, uint32_t nodeIdx);
+SourceLine* sortSourceLines(vec2* points, uint32_t numIndices);
+int compareSourceLines(const void* line, const void* otherLine);
+void renumberSources(BSPNode* node, uint32_t* newSources);
+void addSourceLine(Map* map, BSPNode* node, uint32_t lineStartVert, uint32_t lineEndVert, uint32_t source,
+                   BSPNode*** changedLeaves);
+void updateBounds(Map* map, BSPNode* node);
+void setVertices(Map* map, vec2* vertices, uint32_t numVertices);
+uint64_t computeBuildKey(vec2* vertices, uint32_t numVertices, uint32_t* indices, uint32_t numIndices);
+uint64_t hashBytes(uint64_t hash, const void* data, size_t size);
+bool copyMapFile(const char* sourcePath, const char* destinationPath);
+void runBuildWorker(BuildPool* pool, uint32_t workerIdx);
+void pushBuildTask(BuildWorker* worker, BuildTask task);
+bool popBuildTask(BuildWorker* worker, BuildTask* task);
+void partitionSpace(BuildWorker* worker, BSPNode* node, BSPLines* lines, uint32_t candidateSeed);
+bool pickSplitter(Map* map, BSPLines* lines, uint32_t numCandidates, uint32_t* candidateSeed, uint32_t* splitterIdx);
+LineSide classifyLine(Map* map, uint32_t* splitter, uint32_t lineStartVert, uint32_t lineEndVert);
+LineSide splitLine(Map* map, uint32_t* splitter, uint32_t lineStartVert, uint32_t lineEndVert,
+                   uint32_t* intersectionVertex, bool* lineStartsInFront);
+uint32_t nextCandidate(uint32_t* candidateSeed, uint32_t numLines);
 bool isPointInFront(Map* map, uint32_t* lineIndices, uint32_t pointIdx);
-void memPack(BSPLines* lines);
-void grow(Map* map);
+int32_t pointSide(Map* map, uint32_t* lineIndices, uint32_t pointIdx);
+double orient2d(vec2* a, vec2* b, vec2* p);
+double orient2dExact(vec2* a, vec2* b, vec2* p);
+inline void twoSum(double a, double b, double* sum, double* error);
+inline void twoDiff(double a, double b, double* diff, double* error);
+inline void twoProduct(double a, double b, double* product, double* error);
+vec2 intersectSlopes(vec2* splitterStart, vec2* splitterEnd, vec2* lineStart, vec2* lineEnd);
+vec2 intersectParametric(vec2* splitterStart, vec2* splitterEnd, vec2* lineStart, vec2* lineEnd);
+void* arenaAlloc(Arena* arena, size_t size);
+void* arenaGrow(Arena* arena, void* memory, size_t size, size_t newSize);
+uint32_t addVertex(Map* map, vec2 vertex);
+uint32_t appendVertex(Map* map, vec2 vertex);
+vec2* addVertexChunk(Map* map);
+bool findWeldVertex(Map* map, vec2 vertex, uint32_t* vertexIdx);
+void insertWeldVertex(Map* map, uint32_t vertexIdx);
+uint64_t weldCellKey(int64_t cellX, int64_t cellY);
+uint32_t findWeldCell(WeldTable* table, uint64_t cellKey);
 void printNode(Map* map, BSPNode* node);
-bool isConvex(Map* map, uint32_t* shapeVerts, uint16_t numVerts);
-void writeToFile(BSPNode* node, FILE* file);
+bool isLeafSet(Map* map, BSPLines* lines);
+bool isLineOnHull(Map* map, BSPLines* lines, uint32_t lineIdx, uint32_t* otherLines, uint32_t numOtherLines);
+void computeBounds(Map* map, BSPLines* lines, BSPBounds* bounds);
+void writeToFile(Map* map, BSPNode* root, vec2* sourceLines, uint32_t numSourceIndices, FILE* file);
+void computeLinePlane(Map* map, uint32_t* lineIndices, vec2* normal, float* distance);
+uint32_t computeChecksum(const uint8_t* data, size_t size);
 
 /*
 map-file-format <binary>
@@ -68,6 +340,20 @@ HEADER START
 HEADER END
 (numberOfVertices) <float(s)>
 (numberOfIndices) <uint32(s)>
+
+compiled-map-file-format <binary>
+<BSPFileHeader>
+(numSections) <BSPFileSection(s)>
+(numSections) <section data>, each at its 16 byte aligned offset, zero padded
+
+--incremental takes the tree over from a previous output, the input map's lines are compared to the ones the
+previous output was built from, every compiled line records the input line it was cut from, so the lines of
+removed input lines are taken out of their leaves first, then only the leaves the added lines end up in are built
+again, the build options should be the same as the previous build's
+
+--cache keeps every compiled map in the given directory, named after a hash of the input's vertices and lines
+and of the options that shape the tree, a map that's already there is just copied to the output, without
+building anything, incremental builds depend on the previous output too, so they don't use the cache
 */
 
 int main(int argc, char** argv)
@@ -80,362 +366,1590 @@ int main(int argc, char** argv)
 
     char* inputFilePath = argv[1];
     char* outputFilePath = argv[2];
+    char* previousMapPath = nullptr;
+    char* cacheDirectory = nullptr;
+
+    buildOptions.numThreads = std::thread::hardware_concurrency();
+    for (int argIdx = 3; argIdx < argc; ++argIdx)
+    {
+        if (strcmp(argv[argIdx], "--split-weight") == 0 && argIdx + 1 < argc)
+        {
+            buildOptions.splitWeight = (float)atof(argv[++argIdx]);
+        }
+        else if (strcmp(argv[argIdx], "--balance-weight") == 0 && argIdx + 1 < argc)
+        {
+            buildOptions.balanceWeight = (float)atof(argv[++argIdx]);
+        }
+        else if (strcmp(argv[argIdx], "--candidates") == 0 && argIdx + 1 < argc)
+        {
+            buildOptions.numCandidates = (uint32_t)atoi(argv[++argIdx]);
+        }
+        else if (strcmp(argv[argIdx], "--threads") == 0 && argIdx + 1 < argc)
+        {
+            buildOptions.numThreads = (uint32_t)atoi(argv[++argIdx]);
+        }
+        else if (strcmp(argv[argIdx], "--task-lines") == 0 && argIdx + 1 < argc)
+        {
+            buildOptions.minTaskLines = (uint32_t)atoi(argv[++argIdx]);
+        }
+        else if (strcmp(argv[argIdx], "--weld-epsilon") == 0 && argIdx + 1 < argc)
+        {
+            buildOptions.weldEpsilon = (float)atof(argv[++argIdx]);
+        }
+        else if (strcmp(argv[argIdx], "--exact") == 0)
+        {
+            buildOptions.exactPredicates = true;
+        }
+        else if (strcmp(argv[argIdx], "--snap-distance") == 0 && argIdx + 1 < argc)
+        {
+            buildOptions.snapDistance = (float)atof(argv[++argIdx]);
+        }
+        else if (strcmp(argv[argIdx], "--incremental") == 0 && argIdx + 1 < argc)
+        {
+            previousMapPath = argv[++argIdx];
+        }
+        else if (strcmp(argv[argIdx], "--cache") == 0 && argIdx + 1 < argc)
+        {
+            cacheDirectory = argv[++argIdx];
+        }
+        else
+        {
+            puts(manual);
+            return 1;
+        }
+    }
+
+    if (buildOptions.numThreads == 0)
+        buildOptions.numThreads = 1;
+
+    if (buildOptions.snapDistance < 0.f)
+        buildOptions.snapDistance = buildOptions.weldEpsilon;
 
     FILE* inputFile = fopen(inputFilePath, "rb");
 
     Map map;
     fread(&map, sizeof(uint64_t), 1, inputFile);
-    map.maxVertices = map.numVertices + (map.numVertices / 2);
-    map.vertices = new vec2[map.maxVertices];
+    map.numVertexChunks = 0;
+    map.vertexChunks = new vec2*[MAX_VERTEX_CHUNKS];
 
-    fread(map.vertices, sizeof(vec2), map.numVertices, inputFile);
+    vec2* inputVertices = new vec2[map.numVertices];
+    fread(inputVertices, sizeof(vec2), map.numVertices, inputFile);
 
     BSPLines* initialMapLines = new BSPLines;
     initialMapLines->numIndices = map.numOfIndices;
     initialMapLines->verticesIndecies = new uint32_t[initialMapLines->numIndices];
     fread(initialMapLines->verticesIndecies, sizeof(uint32_t), initialMapLines->numIndices, inputFile);
 
+    initialMapLines->sources = new uint32_t[initialMapLines->numIndices / 2];
+    for (uint32_t lineIdx = 0; lineIdx < initialMapLines->numIndices / 2u; ++lineIdx)
+        initialMapLines->sources[lineIdx] = lineIdx;
+
     fclose(inputFile);
-    BSPNode* root = partitionSpace(&map, initialMapLines);
 
-    FILE* outputFile = fopen(outputFilePath, "wb+");
-    fwrite(&map.numVertices, sizeof(uint32_t), 1, outputFile);
+    // the lines get cut up during the build, so they're saved as they came in, for the next incremental build
+    uint32_t numSourceIndices = initialMapLines->numIndices;
+    vec2* sourceLines = new vec2[numSourceIndices];
+    for (uint32_t pointIdx = 0; pointIdx < numSourceIndices; ++pointIdx)
+        sourceLines[pointIdx] = inputVertices[initialMapLines->verticesIndecies[pointIdx]];
 
-    fwrite(map.vertices, sizeof(vec2), map.numVertices, outputFile);
-    writeToFile(root, outputFile);
+    // the lines are hashed before the build cuts them up
+    char cachePath[MAX_CACHE_PATH] = {};
+    if (cacheDirectory && previousMapPath == nullptr)
+    {
+        uint64_t buildKey = computeBuildKey(inputVertices, map.numVertices, initialMapLines->verticesIndecies,
+                                            initialMapLines->numIndices);
+        snprintf(cachePath, sizeof(cachePath), "%s/%016llx.bsp", cacheDirectory, (unsigned long long)buildKey);
 
-    fclose(outputFile);
-}
+        if (copyMapFile(cachePath, outputFilePath))
+            return 0;
+    }
 
-inline float dot(vec2 const* v1, vec2 const* v2) { return (v1->x * v2->x) + (v1->y * v2->y); }
+    BSPNode* root;
+    if (previousMapPath)
+    {
+        root = rebuildTree(&map, sourceLines, numSourceIndices, previousMapPath, buildOptions.numThreads);
+        if (root == nullptr)
+            return 1;
+    }
+    else
+    {
+        setVertices(&map, inputVertices, map.numVertices);
+        root = buildTree(&map, initialMapLines, buildOptions.numThreads);
+    }
 
-bool isConvex(Map* map, uint32_t* shapeVerts, uint16_t numVerts)
-{
-    bool hadNegativeX = false, hadPositiveX = false, hadNegativeY = false, hadPositiveY = false;
+    delete[] inputVertices;
 
-    vec2* firstLineStart = map->vertices + shapeVerts[0];
-    vec2* firstLineEnd = map->vertices + shapeVerts[1];
+    FILE* outputFile = fopen(outputFilePath, "wb+");
+    writeToFile(&map, root, sourceLines, numSourceIndices, outputFile);
+    fclose(outputFile);
 
-    vec2 currentDelta = { firstLineEnd->x - firstLineStart->x, firstLineEnd->y - firstLineStart->y };
+    delete[] sourceLines;
 
-    for (uint16_t vertIdx = 2; vertIdx < numVerts; vertIdx += 2)
+    // written next to the entry and then renamed, so a build running at the same time never sees half of it,
+    // a failed write only costs the next build its cache hit
+    if (cachePath[0] != '\0')
     {
-        vec2* lineStart = map->vertices + shapeVerts[vertIdx];
-        vec2* lineEnd = map->vertices + shapeVerts[vertIdx + 1];
+        char partialCachePath[MAX_CACHE_PATH + 8];
+        snprintf(partialCachePath, sizeof(partialCachePath), "%s.part", cachePath);
 
-        vec2 delta = { lineEnd->x - lineStart->x, lineEnd->y - lineStart->y };
-
-        if (delta.x > 0)
+        if (!copyMapFile(outputFilePath, partialCachePath) || rename(partialCachePath, cachePath) != 0)
         {
-            if (currentDelta.x < 0)
-            {
-                if (hadPositiveX)
-                    return false;
-
-                hadNegativeX = true;
-            }
-            currentDelta.x = delta.x;
+            remove(partialCachePath);
+            printf("Couldn't write %s, the map isn't cached\n", cachePath);
         }
-        else if (delta.x < 0)
-        {
-            if (currentDelta.x > 0)
-            {
-                if (hadNegativeX)
-                    return false;
+    }
+}
 
-                hadPositiveX = true;
-            }
-            currentDelta.x = delta.x;
-        }
+// 64 bit FNV-1a over everything that decides what the compiled map looks like, the thread count and the task
+// size don't, the tree is the same for any build order, the options are hashed one by one, so padding stays out
+uint64_t computeBuildKey(vec2* vertices, uint32_t numVertices, uint32_t* indices, uint32_t numIndices)
+{
+    uint64_t hash = FNV_OFFSET_BASIS;
+    hash = hashBytes(hash, &BSP_FILE_VERSION, sizeof(BSP_FILE_VERSION));
+    hash = hashBytes(hash, &numVertices, sizeof(numVertices));
+    hash = hashBytes(hash, &numIndices, sizeof(numIndices));
+    hash = hashBytes(hash, vertices, sizeof(vec2) * numVertices);
+    hash = hashBytes(hash, indices, sizeof(uint32_t) * numIndices);
+
+    hash = hashBytes(hash, &buildOptions.splitWeight, sizeof(buildOptions.splitWeight));
+    hash = hashBytes(hash, &buildOptions.balanceWeight, sizeof(buildOptions.balanceWeight));
+    hash = hashBytes(hash, &buildOptions.numCandidates, sizeof(buildOptions.numCandidates));
+    hash = hashBytes(hash, &buildOptions.weldEpsilon, sizeof(buildOptions.weldEpsilon));
+    hash = hashBytes(hash, &buildOptions.exactPredicates, sizeof(buildOptions.exactPredicates));
+    hash = hashBytes(hash, &buildOptions.snapDistance, sizeof(buildOptions.snapDistance));
+    return hash;
+}
 
-        if (delta.y > 0)
-        {
-            if (currentDelta.y < 0)
-            {
-                if (hadPositiveY)
-                    return false;
+uint64_t hashBytes(uint64_t hash, const void* data, size_t size)
+{
+    const uint8_t* bytes = (const uint8_t*)data;
+    for (size_t byteIdx = 0; byteIdx < size; ++byteIdx)
+        hash = (hash ^ bytes[byteIdx]) * FNV_PRIME;
 
-                hadNegativeY = true;
-            }
-            currentDelta.y = delta.y;
-        }
-        else if (delta.y < 0)
-        {
-            if (currentDelta.y > 0)
-            {
-                if (hadNegativeY)
-                    return false;
+    return hash;
+}
 
-                hadPositiveY = true;
-            }
-            currentDelta.y = delta.y;
-        }
+// only a complete compiled map of the current version is copied, so a damaged cache entry just means a rebuild
+bool copyMapFile(const char* sourcePath, const char* destinationPath)
+{
+    FILE* sourceFile = fopen(sourcePath, "rb");
+    if (sourceFile == nullptr)
+        return false;
+
+    fseek(sourceFile, 0, SEEK_END);
+    size_t fileSize = (size_t)ftell(sourceFile);
+    fseek(sourceFile, 0, SEEK_SET);
+
+    uint8_t* fileData = new uint8_t[fileSize];
+    bool isMapValid = fread(fileData, 1, fileSize, sourceFile) == fileSize;
+    fclose(sourceFile);
+
+    BSPFileHeader* header = (BSPFileHeader*)fileData;
+    isMapValid = isMapValid && fileSize >= sizeof(BSPFileHeader) &&
+                 memcmp(header->magic, BSP_FILE_MAGIC, sizeof(header->magic)) == 0 &&
+                 header->version == BSP_FILE_VERSION &&
+                 computeChecksum(fileData + sizeof(BSPFileHeader), fileSize - sizeof(BSPFileHeader)) == header->checksum;
+
+    FILE* destinationFile = isMapValid ? fopen(destinationPath, "wb") : nullptr;
+    if (destinationFile)
+    {
+        isMapValid = fwrite(fileData, 1, fileSize, destinationFile) == fileSize;
+        isMapValid = fclose(destinationFile) == 0 && isMapValid;
     }
-    return true;
-}
 
+    delete[] fileData;
+    return destinationFile && isMapValid;
+}
 
-BSPNode* partitionSpace(Map* map, BSPLines* lines)
+void setVertices(Map* map, vec2* vertices, uint32_t numVertices)
 {
-    BSPNode* node = new BSPNode;
-    node->isLeaf = isConvex(map, lines->verticesIndecies, lines->numIndices);
+    map->numVertices = numVertices;
+    for (uint32_t firstVertex = 0; firstVertex < numVertices; firstVertex += VERTEX_CHUNK_SIZE)
+    {
+        uint32_t numChunkVertices = numVertices - firstVertex;
+        numChunkVertices = numChunkVertices > VERTEX_CHUNK_SIZE ? VERTEX_CHUNK_SIZE : numChunkVertices;
+        memcpy(addVertexChunk(map), vertices + firstVertex, sizeof(vec2) * numChunkVertices);
+    }
 
-    if (node->isLeaf)
+    if (buildOptions.weldEpsilon > 0.f)
     {
-        node->data.lines = lines;
-        return node;
+        for (uint32_t vertexIdx = 0; vertexIdx < numVertices; ++vertexIdx)
+            insertWeldVertex(map, vertexIdx);
     }
+}
+
+inline float dot(vec2 const* v1, vec2 const* v2) { return (v1->x * v2->x) + (v1->y * v2->y); }
 
-    uint16_t splitterIdx = pickSplitter(map, lines);
+inline vec2* vertexAt(Map* map, uint32_t vertexIdx)
+{
+    return map->vertexChunks[vertexIdx >> VERTEX_CHUNK_SHIFT] + (vertexIdx & (VERTEX_CHUNK_SIZE - 1));
+}
 
-    BSPLines* front = new BSPLines;
-    BSPLines* back = new BSPLines;
+// the lines are a leaf when they're all on the boundary of one convex shape, that is when every line has all the
+// others on one side of it (or on it), the walls of a room face each other, the ones of a pillar face away,
+// seen from outside of the shape one wall can still hide another, the renderer picks the nearest one per column,
+// a few lines spread over the set are checked first, as on big sets one of them almost always has lines on
+// both sides, then the rest, stopping at the first line that fails
+bool isLeafSet(Map* map, BSPLines* lines)
+{
+    uint32_t numLines = lines->numIndices / 2;
 
-    front->verticesIndecies = new uint32_t[lines->numIndices];
-    back->verticesIndecies = new uint32_t[lines->numIndices];
+    // a single line (or nothing, when every line ended up on the other side of the splitter) is a leaf
+    if (numLines <= 1)
+        return true;
 
-    BSPLines splitter;
-    splitter.verticesIndecies = lines->verticesIndecies + splitterIdx;
-    splitter.numIndices = 2;
+    uint32_t numSamples = numLines < NUM_LEAF_TEST_SAMPLES ? numLines : NUM_LEAF_TEST_SAMPLES;
+    for (uint32_t sampleIdx = 0; sampleIdx < numSamples; ++sampleIdx)
+    {
+        uint32_t lineIdx = (sampleIdx * numLines) / numSamples;
+        uint32_t otherLines[2] = { (lineIdx + (numLines / 3)) % numLines, (lineIdx + ((2 * numLines) / 3)) % numLines };
 
-    node->splitter[0] = lines->verticesIndecies[splitterIdx];
-    node->splitter[1] = lines->verticesIndecies[splitterIdx + 1];
+        if (!isLineOnHull(map, lines, lineIdx, otherLines, 2))
+            return false;
+    }
 
-    for (uint16_t lineIdx = 0; lineIdx < lines->numIndices; lineIdx += 2)
+    for (uint32_t lineIdx = 0; lineIdx < numLines; ++lineIdx)
     {
-        uint32_t lineStartVert = lines->verticesIndecies[lineIdx];
-        uint32_t lineEndVert = lines->verticesIndecies[lineIdx + 1];
+        if (!isLineOnHull(map, lines, lineIdx, nullptr, numLines))
+            return false;
+    }
 
-        bool lineStartsInFront = isPointInFront(map, &lines->verticesIndecies[splitterIdx], lineStartVert);
-        bool lineEndsInFront = isPointInFront(map, &lines->verticesIndecies[splitterIdx], lineEndVert);
+    return true;
+}
 
-        if (lineIdx == splitterIdx)
-        {
-            continue;
-        }
+// whether the given other lines (all of them, when there's no list) are on one side of the line, the same
+// classification the splitters use, so the leaf test and the partitioning always agree
+bool isLineOnHull(Map* map, BSPLines* lines, uint32_t lineIdx, uint32_t* otherLines, uint32_t numOtherLines)
+{
+    uint32_t* line = lines->verticesIndecies + (lineIdx * 2);
+    bool hasFront = false, hasBack = false;
 
-        if (lineStartVert == node->splitter[1])
-        {
-            BSPLines* side = lineEndsInFront ? front : back;
-            side->verticesIndecies[side->numIndices++] = lineStartVert;
-            side->verticesIndecies[side->numIndices++] = lineEndVert;
+    for (uint32_t otherIdx = 0; otherIdx < numOtherLines; ++otherIdx)
+    {
+        uint32_t otherLineIdx = otherLines ? otherLines[otherIdx] : otherIdx;
+        if (otherLineIdx == lineIdx)
             continue;
-        }
 
-        if (lineEndVert == node->splitter[0])
+        uint32_t* otherLine = lines->verticesIndecies + (otherLineIdx * 2);
+        switch (classifyLine(map, line, otherLine[0], otherLine[1]))
         {
-            BSPLines* side = lineStartsInFront ? front : back;
-            side->verticesIndecies[side->numIndices++] = lineStartVert;
-            side->verticesIndecies[side->numIndices++] = lineEndVert;
-            continue;
-        }
+        case LINE_FRONT:
+            hasFront = true;
+            break;
 
-        if (lineStartsInFront == lineEndsInFront)
-        {
-            BSPLines* side = lineStartsInFront ? front : back;
-            side->verticesIndecies[side->numIndices++] = lineStartVert;
-            side->verticesIndecies[side->numIndices++] = lineEndVert;
-            continue;
+        case LINE_BACK:
+            hasBack = true;
+            break;
+
+        case LINE_SPLIT:
+            return false;
         }
 
-        // the lines intersect
+        if (hasFront && hasBack)
+            return false;
+    }
+
+    return true;
+}
+
+BSPNode* buildTree(Map* map, BSPLines* lines, uint32_t numThreads)
+{
+    BSPNode* root = new BSPNode;
+    buildNodes(map, &root, lines, 1, numThreads);
+    return root;
+}
+
+// every node is built from its lines as the root of a subtree, all of them by the same pool, the calling thread
+// is worker 0, so numThreads == 1 builds the tree the same way the serial recursion did
+void buildNodes(Map* map, BSPNode** nodes, BSPLines* lines, uint32_t numNodes, uint32_t numThreads)
+{
+    BuildPool pool;
+    pool.map = map;
+    pool.numWorkers = numThreads;
+    pool.queues = new BuildQueue[numThreads];
+    pool.treeArenas = new Arena[numThreads];
+    pool.lineArenas = new Arena[numThreads];
+    pool.sourceArenas = new Arena[numThreads];
+    pool.numPendingTasks = 0;
+
+    BuildWorker mainWorker = { &pool, 0, pool.treeArenas, pool.lineArenas, pool.sourceArenas };
+    for (uint32_t nodeIdx = 0; nodeIdx < numNodes; ++nodeIdx)
+        pushBuildTask(&mainWorker, { nodes[nodeIdx], lines[nodeIdx], 0x9E3779B9 });
+
+    std::thread* workers = new std::thread[numThreads - 1];
+    for (uint32_t workerIdx = 1; workerIdx < numThreads; ++workerIdx)
+        workers[workerIdx - 1] = std::thread(runBuildWorker, &pool, workerIdx);
+
+    runBuildWorker(&pool, 0);
+
+    for (uint32_t workerIdx = 1; workerIdx < numThreads; ++workerIdx)
+        workers[workerIdx - 1].join();
 
-        vec2* lineStart = map->vertices + lineStartVert;
-        vec2* lineEnd = map->vertices + lineEndVert;
+    delete[] workers;
 
-        vec2* splitterStart = map->vertices + node->splitter[0];
-        vec2* splitterEnd = map->vertices + node->splitter[1];
+    for (uint32_t queueIdx = 0; queueIdx < numThreads; ++queueIdx)
+        arrfree(pool.queues[queueIdx].tasks);
+    delete[] pool.queues;
+
+    // the arenas go away with the process, just like the tree did before
+}
+
+// the previous tree is taken over as it is, every line in it knows the input line it was cut from, the lines
+// of removed input lines are taken out of their leaves, which keeps those leaves valid, added lines are pushed
+// down the old splitters, cut where they cross one, and every leaf that gets new lines is built again as the
+// root of a subtree, all of them by one pool, the bounds are redone for the whole tree
+BSPNode* rebuildTree(Map* map, vec2* sourceLines, uint32_t numSourceIndices, const char* previousMapPath,
+                     uint32_t numThreads)
+{
+    PreviousMap previous;
+    if (!readPreviousMap(&previous, previousMapPath))
+        return nullptr;
 
-        float splitterRise = splitterEnd->y - splitterStart->y;
-        float splitterRun = splitterEnd->x - splitterStart->x;
-        float splitterSlope = splitterRise / splitterRun;
+    setVertices(map, previous.vertices, previous.numVertices);
+    BSPNode* root = importNode(&previous, 0);
 
-        float lineRise = lineEnd->y - lineStart->y;
-        float lineRun = lineEnd->x - lineStart->x;
-        float lineSlope = lineRise / lineRun;
+    if (root == nullptr)
+    {
+        printf("%s is corrupted, build the map without --incremental\n", previousMapPath);
+        delete[] previous.data;
+        return nullptr;
+    }
 
-        float slope;
-        vec2* start;
+    // both line lists are sorted, so the lines they share fall out of a single merge, a previous line that's still
+    // there gets its new number, one that isn't gets none
+    uint32_t numPreviousLines = previous.numSourceIndices / 2;
+    uint32_t numLines = numSourceIndices / 2;
+    SourceLine* previousLines = sortSourceLines(previous.sourceLines, previous.numSourceIndices);
+    SourceLine* lines = sortSourceLines(sourceLines, numSourceIndices);
+
+    uint32_t* newSources = new uint32_t[numPreviousLines];
+    uint32_t* addedLines = NULL;
+    uint32_t numRemoved = 0;
+    uint32_t previousIdx = 0, currentIdx = 0;
+    while (previousIdx < numPreviousLines || currentIdx < numLines)
+    {
+        int order = previousIdx == numPreviousLines ? 1
+                    : currentIdx == numLines
+                    ? -1
+                    : compareSourceLines(previousLines + previousIdx, lines + currentIdx);
 
-        float intersectionX;
-        if (splitterRun == 0.f)
+        if (order < 0)
         {
-            slope = lineSlope;
-            start = lineStart;
-            intersectionX = splitterStart->x;
+            newSources[previousLines[previousIdx++].index] = NO_SOURCE;
+            ++numRemoved;
         }
-        else if (lineRun == 0.f)
+        else if (order > 0)
         {
-            slope = splitterSlope;
-            start = splitterStart;
-            intersectionX = lineStart->x;
+            arrput(addedLines, lines[currentIdx++].index);
         }
         else
         {
-            slope = splitterSlope;
-            start = splitterStart;
-
-            intersectionX = ((splitterStart->y - (splitterSlope * splitterStart->x)) -
-                             (lineStart->y - (lineSlope * lineStart->x))) /
-                            (lineSlope - splitterSlope);
+            newSources[previousLines[previousIdx++].index] = lines[currentIdx++].index;
         }
+    }
 
-        float intersectionY = (slope * (intersectionX - start->x)) + start->y;
+    delete[] previousLines;
+    delete[] lines;
+    delete[] previous.data;
 
-        uint32_t intersectionVertex = map->numVertices++;
-        if (intersectionVertex >= map->maxVertices)
-            grow(map);
+    // all the removals go first, so the lines that are taken out can only be ones of the previous build
+    renumberSources(root, newSources);
+    delete[] newSources;
 
-        map->vertices[intersectionVertex] = { intersectionX, intersectionY };
+    BSPNode** changedLeaves = NULL;
+    for (uint32_t addedIdx = 0; addedIdx < arrlenu(addedLines); ++addedIdx)
+    {
+        vec2* line = sourceLines + (addedLines[addedIdx] * 2);
+        uint32_t lineStartVert = addVertex(map, line[0]);
+        uint32_t lineEndVert = addVertex(map, line[1]);
+        addSourceLine(map, root, lineStartVert, lineEndVert, addedLines[addedIdx], &changedLeaves);
+    }
 
-        {
-            BSPLines* f = lineStartsInFront ? front : back;
-            BSPLines* b = lineStartsInFront ? back : front;
+    uint32_t numChangedLeaves = (uint32_t)arrlenu(changedLeaves);
+    BSPLines* changedLines = new BSPLines[numChangedLeaves];
+    for (uint32_t leafIdx = 0; leafIdx < numChangedLeaves; ++leafIdx)
+        changedLines[leafIdx] = *changedLeaves[leafIdx]->data.lines;
 
-            f->verticesIndecies[f->numIndices++] = lineStartVert;
-            f->verticesIndecies[f->numIndices++] = intersectionVertex;
+    buildNodes(map, changedLeaves, changedLines, numChangedLeaves, numThreads);
+    updateBounds(map, root);
 
-            b->verticesIndecies[b->numIndices++] = intersectionVertex;
-            b->verticesIndecies[b->numIndices++] = lineEndVert;
-        }
+    printf("%u lines added, %u lines removed, %u of %u leaves rebuilt\n", (uint32_t)arrlenu(addedLines), numRemoved,
+           numChangedLeaves, previous.numLeaves);
+
+    delete[] changedLines;
+    arrfree(changedLeaves);
+    arrfree(addedLines);
+    return root;
+}
+
+// the whole file is read in, its checksum checked and its sections looked up, like the renderer does
+bool readPreviousMap(PreviousMap* previous, const char* previousMapPath)
+{
+    *previous = {};
+
+    FILE* file = fopen(previousMapPath, "rb");
+    if (file == nullptr)
+    {
+        printf("Failed to open map file %s\n", previousMapPath);
+        return false;
     }
 
-    back->verticesIndecies[back->numIndices++] = node->splitter[0];
-    back->verticesIndecies[back->numIndices++] = node->splitter[1];
+    fseek(file, 0, SEEK_END);
+    previous->size = (size_t)ftell(file);
+    fseek(file, 0, SEEK_SET);
+
+    previous->data = new uint8_t[previous->size];
+    bool isMapValid = fread(previous->data, 1, previous->size, file) == previous->size;
+    fclose(file);
 
+    BSPFileHeader* header = (BSPFileHeader*)previous->data;
+    isMapValid = isMapValid && previous->size >= sizeof(BSPFileHeader) &&
+                 memcmp(header->magic, BSP_FILE_MAGIC, sizeof(header->magic)) == 0 &&
+                 header->version == BSP_FILE_VERSION &&
+                 header->numSections <= (previous->size - sizeof(BSPFileHeader)) / sizeof(BSPFileSection) &&
+                 computeChecksum(previous->data + sizeof(BSPFileHeader), previous->size - sizeof(BSPFileHeader)) ==
+                 header->checksum;
 
-    memPack(front);
-    memPack(back);
+    BSPFileSection* sectionTable = (BSPFileSection*)(previous->data + sizeof(BSPFileHeader));
+    for (uint32_t sectionIdx = 0; isMapValid && sectionIdx < header->numSections; ++sectionIdx)
+    {
+        if (sectionTable[sectionIdx].type < NUM_BSP_SECTION_TYPES)
+            previous->sections[sectionTable[sectionIdx].type] = sectionTable + sectionIdx;
+    }
 
-    delete[] lines->verticesIndecies;
-    delete lines;
+    if (isMapValid)
+    {
+        uint32_t numSplitterIndices, numLineSources;
+        previous->vertices =
+        (vec2*)previousSection(previous, BSP_SECTION_VERTICES, sizeof(vec2), &previous->numVertices);
+        previous->nodes =
+        (BSPFileNode*)previousSection(previous, BSP_SECTION_NODES, sizeof(BSPFileNode), &previous->numNodes);
+        previous->leaves =
+        (BSPFileLeaf*)previousSection(previous, BSP_SECTION_LEAVES, sizeof(BSPFileLeaf), &previous->numLeaves);
+        previous->segments =
+        (uint32_t*)previousSection(previous, BSP_SECTION_SEGMENTS, sizeof(uint32_t), &previous->numSegmentIndices);
+        previous->splitters =
+        (uint32_t*)previousSection(previous, BSP_SECTION_SPLITTERS, sizeof(uint32_t), &numSplitterIndices);
+        previous->sourceLines =
+        (vec2*)previousSection(previous, BSP_SECTION_SOURCE_LINES, sizeof(vec2), &previous->numSourceIndices);
+        previous->lineSources =
+        (uint32_t*)previousSection(previous, BSP_SECTION_LINE_SOURCES, sizeof(uint32_t), &numLineSources);
+
+        isMapValid = previous->vertices && previous->nodes && previous->leaves && previous->segments &&
+                     previous->splitters && previous->sourceLines && previous->lineSources &&
+                     previous->numNodes > 0 && numSplitterIndices == previous->numNodes * 2 &&
+                     numLineSources * 2 == previous->numSegmentIndices;
+    }
 
-    node->data.children = new BSPChildren;
-    node->data.children->frontChild = partitionSpace(map, front);
-    node->data.children->backChild = partitionSpace(map, back);
+    if (!isMapValid)
+    {
+        printf("%s is not a compiled map with incremental build data, build the map without --incremental\n",
+               previousMapPath);
+        delete[] previous->data;
+        return false;
+    }
 
-    return node;
+    return true;
 }
 
-uint16_t pickSplitter(Map* map, BSPLines* lines)
+// null when the section is missing, out of the file or not made of whole elements
+void* previousSection(PreviousMap* previous, uint32_t type, uint32_t elementSize, uint32_t* count)
 {
-    vec2 middle;
-    for (uint32_t pointIdx = 0; pointIdx < lines->numIndices; pointIdx += 2)
-    {
-        middle.x += map->vertices[lines->verticesIndecies[pointIdx]].x;
-        middle.y += map->vertices[lines->verticesIndecies[pointIdx]].y;
-    }
+    BSPFileSection* section = previous->sections[type];
 
-    middle.x /= (lines->numIndices / 2);
-    middle.y /= (lines->numIndices / 2);
+    *count = 0;
+    if (section == nullptr || (size_t)section->offset + section->size > previous->size ||
+        (size_t)section->count * elementSize != section->size)
+        return nullptr;
 
-    float minDistance = FLT_MAX;
-    uint32_t closestPointIdx = 0;
+    *count = section->count;
+    return previous->data + section->offset;
+}
 
-    for (uint32_t pointIdx = 0; pointIdx < lines->numIndices; pointIdx += 2)
-    {
-        vec2 toMiddleVec{ middle.x - map->vertices[lines->verticesIndecies[pointIdx]].x,
-                          middle.y - map->vertices[lines->verticesIndecies[pointIdx]].y };
+// the children always come after their parent in the file, so following them can't loop, null when an index
+// points outside of the file's arrays, the leaves' lines are copied out, as they can lose and get lines,
+// the bounds aren't taken over, they're redone once the tree is updated
+BSPNode* importNode(PreviousMap* previous, uint32_t nodeIdx)
+{
+    BSPFileNode* fileNode = previous->nodes + nodeIdx;
+    BSPNode* node = new BSPNode;
+    node->isLeaf = (fileNode->children & BSP_LEAF_NODE) != 0;
 
-        float distance = sqrtf((toMiddleVec.x * toMiddleVec.x) + (toMiddleVec.y * toMiddleVec.y));
-        if (distance < minDistance)
+    if (node->isLeaf)
+    {
+        uint32_t leafIdx = fileNode->children & ~BSP_LEAF_NODE;
+        BSPFileLeaf* leaf = previous->leaves + leafIdx;
+        if (leafIdx >= previous->numLeaves || leaf->numIndices > previous->numSegmentIndices ||
+            leaf->firstIndex > previous->numSegmentIndices - leaf->numIndices)
+            return nullptr;
+
+        node->data.lines = new BSPLines;
+        node->data.lines->numIndices = leaf->numIndices;
+        node->data.lines->verticesIndecies = NULL;
+        node->data.lines->sources = NULL;
+        for (uint32_t pointIdx = 0; pointIdx < leaf->numIndices; ++pointIdx)
+            arrput(node->data.lines->verticesIndecies, previous->segments[leaf->firstIndex + pointIdx]);
+
+        for (uint32_t lineIdx = 0; lineIdx < leaf->numIndices / 2; ++lineIdx)
         {
-            minDistance = distance;
-            closestPointIdx = pointIdx;
+            uint32_t source = previous->lineSources[(leaf->firstIndex / 2) + lineIdx];
+            if (source >= previous->numSourceIndices / 2)
+                return nullptr;
+
+            arrput(node->data.lines->sources, source);
         }
+
+        return node;
     }
 
-    return closestPointIdx;
-}
+    if (fileNode->children <= nodeIdx || fileNode->children >= previous->numNodes - 1)
+        return nullptr;
 
-bool isPointInFront(Map* map, uint32_t* lineIndices, uint32_t pointIdx)
-{
-    vec2* lineStart = map->vertices + lineIndices[0];
-    vec2* lineEnd = map->vertices + lineIndices[1];
+    node->splitter[0] = previous->splitters[nodeIdx * 2];
+    node->splitter[1] = previous->splitters[(nodeIdx * 2) + 1];
+    if (node->splitter[0] >= previous->numVertices || node->splitter[1] >= previous->numVertices)
+        return nullptr;
 
-    vec2* point = map->vertices + pointIdx;
+    node->data.children = new BSPChildren;
+    node->data.children->frontChild = importNode(previous, fileNode->children);
+    node->data.children->backChild = importNode(previous, fileNode->children + 1);
 
-    vec2 pointVec{ point->x - lineStart->x, point->y - lineStart->y };
-    vec2 lineVec{ lineEnd->x - lineStart->x, lineEnd->y - lineStart->y };
+    if (node->data.children->frontChild == nullptr || node->data.children->backChild == nullptr)
+        return nullptr;
 
-    return lineVec.x * pointVec.y > lineVec.y * pointVec.x;
+    return node;
 }
 
-void memPack(BSPLines* lines)
+// the indices of the input lines, in the order of compareSourceLines()
+SourceLine* sortSourceLines(vec2* points, uint32_t numIndices)
 {
-    uint32_t* tmp = new uint32_t[lines->numIndices];
-    memcpy(tmp, lines->verticesIndecies, sizeof(uint32_t) * lines->numIndices);
-    delete[] lines->verticesIndecies;
-    lines->verticesIndecies = tmp;
+    SourceLine* lines = new SourceLine[numIndices / 2];
+    for (uint32_t lineIdx = 0; lineIdx < numIndices / 2; ++lineIdx)
+    {
+        lines[lineIdx].points[0] = points[lineIdx * 2];
+        lines[lineIdx].points[1] = points[(lineIdx * 2) + 1];
+        lines[lineIdx].index = lineIdx;
+    }
+
+    qsort(lines, numIndices / 2, sizeof(SourceLine), compareSourceLines);
+    return lines;
 }
 
-void grow(Map* map)
+// any consistent order does, the lines only have to be matched bit for bit
+int compareSourceLines(const void* line, const void* otherLine)
 {
-    vec2* biggerMap = new vec2[map->numVertices + (map->numVertices / 2)];
-    memcpy(biggerMap, map->vertices, sizeof(vec2) * map->numVertices);
-    delete[] map->vertices;
-    map->vertices = biggerMap;
+    return memcmp(((SourceLine*)line)->points, ((SourceLine*)otherLine)->points, sizeof(vec2) * 2);
 }
 
-void writeToFile(BSPNode* node, FILE* file)
+// the lines of removed input lines are dropped, the others get the number of their input line in the new input
+void renumberSources(BSPNode* node, uint32_t* newSources)
 {
-    static uint32_t innerNodeSize = sizeof(bool) + (sizeof(uint32_t) * 4);
-    BSPNode** queue = NULL;
-    arrput(queue, node);
+    if (!node->isLeaf)
+    {
+        renumberSources(node->data.children->frontChild, newSources);
+        renumberSources(node->data.children->backChild, newSources);
+        return;
+    }
 
-    while (arrlenu(queue))
+    BSPLines* lines = node->data.lines;
+    uint32_t numKept = 0;
+    for (uint32_t lineIdx = 0; lineIdx < lines->numIndices; lineIdx += 2)
     {
-        uint32_t currLevelSize = 0;
-        for (uint32_t nodeIdx = 0; nodeIdx < arrlenu(queue); ++nodeIdx)
-        {
-            if (queue[nodeIdx]->isLeaf)
-            {
-                currLevelSize += (sizeof(bool) + sizeof(uint16_t) + (sizeof(float) * 3) +
-                                  (sizeof(uint32_t) * queue[nodeIdx]->data.lines->numIndices));
-            }
-            else
-            {
-                currLevelSize += innerNodeSize;
-            }
-        }
+        uint32_t source = newSources[lines->sources[lineIdx / 2]];
+        if (source == NO_SOURCE)
+            continue;
 
-        BSPNode* current = queue[0];
-        arrdel(queue, 0);
-        fwrite(&current->isLeaf, sizeof(bool), 1, file);
+        lines->sources[numKept / 2] = source;
+        lines->verticesIndecies[numKept++] = lines->verticesIndecies[lineIdx];
+        lines->verticesIndecies[numKept++] = lines->verticesIndecies[lineIdx + 1];
+    }
 
-        if (current->isLeaf)
-        {
-            float color[3];
-            for (uint32_t channelIdx = 0; channelIdx < 3; ++channelIdx)
-            {
-                color[channelIdx] = ((float)(rand() % 255)) / 255.f;
-            }
+    lines->numIndices = numKept;
+    arrsetlen(lines->verticesIndecies, numKept);
+    arrsetlen(lines->sources, numKept / 2);
+}
 
-            fwrite(color, sizeof(color), 1, file);
-            fwrite(&current->data.lines->numIndices, sizeof(uint16_t), 1, file);
-            fwrite(current->data.lines->verticesIndecies, sizeof(uint32_t),
-                   current->data.lines->numIndices, file);
-        }
-        else
-        {
-            fwrite(current->splitter, sizeof(uint32_t), 2, file);
-            fwrite(&currLevelSize, sizeof(uint32_t), 1, file); // offset to front child
+// the same classification and cuts as partitionSpace(), so the pieces end up where a full build would put them
+void addSourceLine(Map* map, BSPNode* node, uint32_t lineStartVert, uint32_t lineEndVert, uint32_t source,
+                   BSPNode*** changedLeaves)
+{
+    if (node->isLeaf)
+    {
+        arrput(node->data.lines->verticesIndecies, lineStartVert);
+        arrput(node->data.lines->verticesIndecies, lineEndVert);
+        arrput(node->data.lines->sources, source);
+        node->data.lines->numIndices += 2;
 
-            if (current->data.children->frontChild->isLeaf)
-            {
-                currLevelSize +=
-                (sizeof(bool) + sizeof(uint16_t) + (sizeof(float) * 3) +
-                 (sizeof(uint32_t) * current->data.children->frontChild->data.lines->numIndices));
-            }
-            else
-            {
-                currLevelSize += innerNodeSize;
-            }
+        uint32_t leafIdx = 0;
+        while (leafIdx < arrlenu(*changedLeaves) && (*changedLeaves)[leafIdx] != node)
+            ++leafIdx;
 
-            fwrite(&currLevelSize, sizeof(uint32_t), 1, file); // offset to back child
+        if (leafIdx == arrlenu(*changedLeaves))
+            arrput(*changedLeaves, node);
 
-            arrput(queue, current->data.children->frontChild);
-            arrput(queue, current->data.children->backChild);
-        }
+        return;
     }
+
+    BSPNode* frontChild = node->data.children->frontChild;
+    BSPNode* backChild = node->data.children->backChild;
+
+    bool lineStartsInFront;
+    uint32_t intersectionVertex;
+    LineSide side = classifyLine(map, node->splitter, lineStartVert, lineEndVert);
+    if (side == LINE_SPLIT)
+        side = splitLine(map, node->splitter, lineStartVert, lineEndVert, &intersectionVertex, &lineStartsInFront);
+
+    switch (side)
+    {
+    case LINE_FRONT:
+        addSourceLine(map, frontChild, lineStartVert, lineEndVert, source, changedLeaves);
+        break;
+
+    case LINE_BACK:
+        addSourceLine(map, backChild, lineStartVert, lineEndVert, source, changedLeaves);
+        break;
+
+    case LINE_SPLIT:
+    {
+        BSPNode* startChild = lineStartsInFront ? frontChild : backChild;
+        BSPNode* endChild = lineStartsInFront ? backChild : frontChild;
+        addSourceLine(map, startChild, lineStartVert, intersectionVertex, source, changedLeaves);
+        addSourceLine(map, endChild, intersectionVertex, lineEndVert, source, changedLeaves);
+        break;
+    }
+    }
+}
+
+// the inner nodes' bounds are the union of their children's, just like when they're built
+void updateBounds(Map* map, BSPNode* node)
+{
+    if (node->isLeaf)
+    {
+        computeBounds(map, node->data.lines, &node->bounds);
+        return;
+    }
+
+    BSPBounds* frontBounds = &node->data.children->frontChild->bounds;
+    BSPBounds* backBounds = &node->data.children->backChild->bounds;
+    updateBounds(map, node->data.children->frontChild);
+    updateBounds(map, node->data.children->backChild);
+
+    node->bounds.min = { fminf(frontBounds->min.x, backBounds->min.x), fminf(frontBounds->min.y, backBounds->min.y) };
+    node->bounds.max = { fmaxf(frontBounds->max.x, backBounds->max.x), fmaxf(frontBounds->max.y, backBounds->max.y) };
+}
+
+// a task is only counted as done after it queued its own subtasks, so no pending tasks means the tree is built
+void runBuildWorker(BuildPool* pool, uint32_t workerIdx)
+{
+    BuildWorker worker = { pool, workerIdx, pool->treeArenas + workerIdx, pool->lineArenas + workerIdx,
+                           pool->sourceArenas + workerIdx };
+
+    while (pool->numPendingTasks.load() > 0)
+    {
+        BuildTask task;
+        if (!popBuildTask(&worker, &task))
+        {
+            std::this_thread::yield();
+            continue;
+        }
+
+        partitionSpace(&worker, task.node, &task.lines, task.candidateSeed);
+        pool->numPendingTasks.fetch_sub(1);
+    }
+
+    arrfree(worker.splitLines);
+    arrfree(worker.backLines);
+    arrfree(worker.backHalves);
+    arrfree(worker.splitSources);
+    arrfree(worker.backSources);
+}
+
+void pushBuildTask(BuildWorker* worker, BuildTask task)
+{
+    BuildQueue* queue = worker->pool->queues + worker->workerIdx;
+
+    worker->pool->numPendingTasks.fetch_add(1);
+
+    std::lock_guard<std::mutex> lock(queue->mutex);
+    arrput(queue->tasks, task);
+}
+
+// own queue from the back, then the other queues from the front
+bool popBuildTask(BuildWorker* worker, BuildTask* task)
+{
+    BuildPool* pool = worker->pool;
+
+    {
+        BuildQueue* queue = pool->queues + worker->workerIdx;
+        std::lock_guard<std::mutex> lock(queue->mutex);
+
+        if (queue->firstTask < arrlenu(queue->tasks))
+        {
+            *task = arrpop(queue->tasks);
+            if (queue->firstTask == arrlenu(queue->tasks))
+            {
+                arrsetlen(queue->tasks, 0);
+                queue->firstTask = 0;
+            }
+            return true;
+        }
+    }
+
+    for (uint32_t victimOffset = 1; victimOffset < pool->numWorkers; ++victimOffset)
+    {
+        BuildQueue* queue = pool->queues + ((worker->workerIdx + victimOffset) % pool->numWorkers);
+        std::lock_guard<std::mutex> lock(queue->mutex);
+
+        if (queue->firstTask < arrlenu(queue->tasks))
+        {
+            *task = queue->tasks[queue->firstTask++];
+            if (queue->firstTask == arrlenu(queue->tasks))
+            {
+                arrsetlen(queue->tasks, 0);
+                queue->firstTask = 0;
+            }
+            return true;
+        }
+    }
+
+    return false;
+}
+
+// the lines are partitioned in place into [front | split | back], each part keeps the lines in their order,
+// so the tree doesn't depend on how the partitioning moves them around, a split line keeps its front half and its
+// back half goes right behind the node's lines, so the children are [front | split] and [back | back halves],
+// that needs the node's lines to end at the top of the worker's line arena, the back child always does,
+// the front child (built after the back one) and stolen tasks are moved there, but only when they cut something
+void partitionSpace(BuildWorker* worker, BSPNode* node, BSPLines* lines, uint32_t candidateSeed)
+{
+    Map* map = worker->pool->map;
+    computeBounds(map, lines, &node->bounds);
+
+    uint32_t splitterIdx;
+    node->isLeaf = isLeafSet(map, lines) ||
+                   !pickSplitter(map, lines, buildOptions.numCandidates, &candidateSeed, &splitterIdx);
+
+    if (node->isLeaf)
+    {
+        node->data.lines = (BSPLines*)arenaAlloc(worker->treeArena, sizeof(BSPLines));
+        *node->data.lines = *lines;
+        return;
+    }
+
+    node->splitter[0] = lines->verticesIndecies[splitterIdx];
+    node->splitter[1] = lines->verticesIndecies[splitterIdx + 1];
+
+    // the splitter itself ends up in the back, as none of its points are in front of it, the front lines are
+    // moved down over the ones already read, the others wait in the worker's scratch until the front is done,
+    // a line is cut as soon as it's read, its front half waits with the split lines, its back half on its own
+    uint32_t* indices = lines->verticesIndecies;
+    uint32_t* sources = lines->sources;
+    uint32_t firstSplit = 0;
+    arrsetlen(worker->splitLines, 0);
+    arrsetlen(worker->backLines, 0);
+    arrsetlen(worker->backHalves, 0);
+    arrsetlen(worker->splitSources, 0);
+    arrsetlen(worker->backSources, 0);
+    for (uint32_t lineIdx = 0; lineIdx < lines->numIndices; lineIdx += 2)
+    {
+        uint32_t lineStartVert = indices[lineIdx];
+        uint32_t lineEndVert = indices[lineIdx + 1];
+        uint32_t source = sources[lineIdx / 2];
+
+        bool lineStartsInFront;
+        uint32_t intersectionVertex;
+        LineSide side = classifyLine(map, node->splitter, lineStartVert, lineEndVert);
+        if (side == LINE_SPLIT)
+            side = splitLine(map, node->splitter, lineStartVert, lineEndVert, &intersectionVertex, &lineStartsInFront);
+
+        switch (side)
+        {
+        case LINE_FRONT:
+            sources[firstSplit / 2] = source;
+            indices[firstSplit++] = lineStartVert;
+            indices[firstSplit++] = lineEndVert;
+            break;
+
+        case LINE_BACK:
+            arrput(worker->backLines, lineStartVert);
+            arrput(worker->backLines, lineEndVert);
+            arrput(worker->backSources, source);
+            break;
+
+        case LINE_SPLIT:
+            arrput(worker->splitLines, lineStartsInFront ? lineStartVert : intersectionVertex);
+            arrput(worker->splitLines, lineStartsInFront ? intersectionVertex : lineEndVert);
+            arrput(worker->backHalves, lineStartsInFront ? intersectionVertex : lineStartVert);
+            arrput(worker->backHalves, lineStartsInFront ? lineEndVert : intersectionVertex);
+            arrput(worker->splitSources, source);
+            break;
+        }
+    }
+
+    // with no whole line in front the back gets a piece of every line of the node, the same lines again, that
+    // happens when the cuts land next to the splitter instead of on it, or weren't made at all, the back would
+    // pick the same splitter forever, so the lines stay together in a leaf, nothing's been moved yet
+    if (firstSplit == 0)
+    {
+        node->isLeaf = true;
+        node->data.lines = (BSPLines*)arenaAlloc(worker->treeArena, sizeof(BSPLines));
+        *node->data.lines = *lines;
+        return;
+    }
+
+    uint32_t numSplitIndices = (uint32_t)arrlenu(worker->splitLines);
+    if (numSplitIndices > 0)
+    {
+        indices = (uint32_t*)arenaGrow(worker->lineArena, indices, sizeof(uint32_t) * lines->numIndices,
+                                       sizeof(uint32_t) * (lines->numIndices + numSplitIndices));
+        sources = (uint32_t*)arenaGrow(worker->sourceArena, sources, sizeof(uint32_t) * (lines->numIndices / 2),
+                                       sizeof(uint32_t) * ((lines->numIndices + numSplitIndices) / 2));
+    }
+
+    uint32_t firstBack = firstSplit + numSplitIndices;
+    uint32_t firstBackHalf = firstBack + (uint32_t)arrlenu(worker->backLines);
+    memcpy(indices + firstSplit, worker->splitLines, sizeof(uint32_t) * numSplitIndices);
+    memcpy(indices + firstBack, worker->backLines, sizeof(uint32_t) * arrlenu(worker->backLines));
+    memcpy(indices + firstBackHalf, worker->backHalves, sizeof(uint32_t) * numSplitIndices);
+    memcpy(sources + (firstSplit / 2), worker->splitSources, sizeof(uint32_t) * arrlenu(worker->splitSources));
+    memcpy(sources + (firstBack / 2), worker->backSources, sizeof(uint32_t) * arrlenu(worker->backSources));
+    memcpy(sources + (firstBackHalf / 2), worker->splitSources, sizeof(uint32_t) * arrlenu(worker->splitSources));
+
+    BSPLines front, back;
+    front.numIndices = firstBack;
+    front.verticesIndecies = indices;
+    front.sources = sources;
+    back.numIndices = lines->numIndices + numSplitIndices - firstBack;
+    back.verticesIndecies = indices + firstBack;
+    back.sources = sources + (firstBack / 2);
+
+    node->data.children = (BSPChildren*)arenaAlloc(worker->treeArena, sizeof(BSPChildren));
+    node->data.children->frontChild = (BSPNode*)arenaAlloc(worker->treeArena, sizeof(BSPNode));
+    node->data.children->backChild = (BSPNode*)arenaAlloc(worker->treeArena, sizeof(BSPNode));
+
+    // the children sample their candidates from different seeds, so the tree doesn't depend on the build order
+    uint32_t backSeed = candidateSeed * 0x9E3779B9;
+
+    if (worker->pool->numWorkers > 1 && front.numIndices / 2 >= buildOptions.minTaskLines)
+    {
+        pushBuildTask(worker, { node->data.children->frontChild, front, candidateSeed });
+        partitionSpace(worker, node->data.children->backChild, &back, backSeed);
+    }
+    else
+    {
+        partitionSpace(worker, node->data.children->backChild, &back, backSeed);
+        partitionSpace(worker, node->data.children->frontChild, &front, candidateSeed);
+    }
+}
+
+// bounds of all the segments in the node's subtree, the renderer uses them to cull whole subtrees
+void computeBounds(Map* map, BSPLines* lines, BSPBounds* bounds)
+{
+    bounds->min = { FLT_MAX, FLT_MAX };
+    bounds->max = { -FLT_MAX, -FLT_MAX };
+
+    for (uint32_t pointIdx = 0; pointIdx < lines->numIndices; ++pointIdx)
+    {
+        vec2* point = vertexAt(map, lines->verticesIndecies[pointIdx]);
+
+        bounds->min.x = point->x < bounds->min.x ? point->x : bounds->min.x;
+        bounds->min.y = point->y < bounds->min.y ? point->y : bounds->min.y;
+        bounds->max.x = point->x > bounds->max.x ? point->x : bounds->max.x;
+        bounds->max.y = point->y > bounds->max.y ? point->y : bounds->max.y;
+    }
+}
+
+// the splitter always goes to the back, so a candidate with nothing in front would just hand the same lines
+// down again, returns false when every line is like that, all the lines face away from each other then
+bool pickSplitter(Map* map, BSPLines* lines, uint32_t numCandidates, uint32_t* candidateSeed, uint32_t* splitterIdx)
+{
+    uint32_t numLines = lines->numIndices / 2;
+    bool sampleCandidates = numCandidates > 0 && numCandidates < numLines;
+    numCandidates = sampleCandidates ? numCandidates : numLines;
+
+    float bestScore = FLT_MAX;
+    bool foundSplitter = false;
+
+    for (uint32_t candidateIdx = 0; candidateIdx < numCandidates; ++candidateIdx)
+    {
+        uint32_t candidateSplitterIdx = (sampleCandidates ? nextCandidate(candidateSeed, numLines) : candidateIdx) * 2;
+        uint32_t* splitter = lines->verticesIndecies + candidateSplitterIdx;
+
+        uint32_t numFront = 0, numBack = 0, numSplits = 0;
+        for (uint32_t lineIdx = 0; lineIdx < lines->numIndices; lineIdx += 2)
+        {
+            if (lineIdx == candidateSplitterIdx)
+                continue;
+
+            switch (classifyLine(map, splitter, lines->verticesIndecies[lineIdx], lines->verticesIndecies[lineIdx + 1]))
+            {
+            case LINE_FRONT:
+                ++numFront;
+                break;
+
+            case LINE_BACK:
+                ++numBack;
+                break;
+
+            case LINE_SPLIT:
+                ++numFront;
+                ++numBack;
+                ++numSplits;
+                break;
+            }
+
+            // the splits alone are already worse than the best candidate
+            if (buildOptions.splitWeight * numSplits >= bestScore)
+                break;
+        }
+
+        if (numFront == 0)
+            continue;
+
+        // the splitter itself goes to the back
+        ++numBack;
+
+        float imbalance = numFront > numBack ? (float)(numFront - numBack) : (float)(numBack - numFront);
+        float score = (buildOptions.splitWeight * numSplits) + (buildOptions.balanceWeight * imbalance);
+
+        if (!foundSplitter || score < bestScore)
+        {
+            bestScore = score;
+            *splitterIdx = candidateSplitterIdx;
+            foundSplitter = true;
+        }
+    }
+
+    // the sample might have missed the only usable lines
+    if (!foundSplitter && sampleCandidates)
+        foundSplitter = pickSplitter(map, lines, 0, candidateSeed, splitterIdx);
+
+    return foundSplitter;
+}
+
+// lines sharing the splitter's start/end point are assigned by their other point, as the shared
+// one lies on the splitter, everything with points on both sides has to be cut in two
+LineSide classifyLine(Map* map, uint32_t* splitter, uint32_t lineStartVert, uint32_t lineEndVert)
+{
+    // any point on the splitter counts as shared, lines lying on it go to the back, like the splitter does
+    if (buildOptions.exactPredicates)
+    {
+        int32_t startSide = pointSide(map, splitter, lineStartVert);
+        int32_t endSide = pointSide(map, splitter, lineEndVert);
+
+        if (startSide == 0 && endSide == 0)
+            return LINE_BACK;
+
+        if (startSide >= 0 && endSide >= 0)
+            return LINE_FRONT;
+
+        if (startSide <= 0 && endSide <= 0)
+            return LINE_BACK;
+
+        return LINE_SPLIT;
+    }
+
+    bool lineStartsInFront = isPointInFront(map, splitter, lineStartVert);
+    bool lineEndsInFront = isPointInFront(map, splitter, lineEndVert);
+
+    if (lineStartVert == splitter[1])
+        return lineEndsInFront ? LINE_FRONT : LINE_BACK;
+
+    if (lineEndVert == splitter[0])
+        return lineStartsInFront ? LINE_FRONT : LINE_BACK;
+
+    if (lineStartsInFront == lineEndsInFront)
+        return lineStartsInFront ? LINE_FRONT : LINE_BACK;
+
+    return LINE_SPLIT;
+}
+
+// the vertex where the line crosses the splitter, a cut within weldEpsilon of one of the line's own points would
+// give one side the whole line and the other a line of length 0, so the line isn't cut and goes to the side of
+// its other point, otherwise only a vertex on the splitter is welded to, any other would move the cut off it
+LineSide splitLine(Map* map, uint32_t* splitter, uint32_t lineStartVert, uint32_t lineEndVert,
+                   uint32_t* intersectionVertex, bool* lineStartsInFront)
+{
+    *lineStartsInFront = buildOptions.exactPredicates ? pointSide(map, splitter, lineStartVert) > 0
+                                                      : isPointInFront(map, splitter, lineStartVert);
+
+    vec2* lineStart = vertexAt(map, lineStartVert);
+    vec2* lineEnd = vertexAt(map, lineEndVert);
+
+    vec2* splitterStart = vertexAt(map, splitter[0]);
+    vec2* splitterEnd = vertexAt(map, splitter[1]);
+
+    vec2 intersection = buildOptions.exactPredicates
+                        ? intersectParametric(splitterStart, splitterEnd, lineStart, lineEnd)
+                        : intersectSlopes(splitterStart, splitterEnd, lineStart, lineEnd);
+
+    float maxDistanceSq = buildOptions.weldEpsilon * buildOptions.weldEpsilon;
+    vec2 startDelta = { intersection.x - lineStart->x, intersection.y - lineStart->y };
+    vec2 endDelta = { intersection.x - lineEnd->x, intersection.y - lineEnd->y };
+
+    if (dot(&startDelta, &startDelta) <= maxDistanceSq)
+        return *lineStartsInFront ? LINE_BACK : LINE_FRONT;
+
+    if (dot(&endDelta, &endDelta) <= maxDistanceSq)
+        return *lineStartsInFront ? LINE_FRONT : LINE_BACK;
+
+    std::lock_guard<std::mutex> lock(map->verticesMutex);
+
+    if (buildOptions.weldEpsilon > 0.f && findWeldVertex(map, intersection, intersectionVertex) &&
+        pointSide(map, splitter, *intersectionVertex) == 0)
+        return LINE_SPLIT;
+
+    *intersectionVertex = appendVertex(map, intersection);
+    return LINE_SPLIT;
+}
+
+// xorshift, so the candidates are the same on every run and rand() is left alone for the leaf colors
+uint32_t nextCandidate(uint32_t* candidateSeed, uint32_t numLines)
+{
+    *candidateSeed ^= *candidateSeed << 13;
+    *candidateSeed ^= *candidateSeed >> 17;
+    *candidateSeed ^= *candidateSeed << 5;
+    return *candidateSeed % numLines;
+}
+
+bool isPointInFront(Map* map, uint32_t* lineIndices, uint32_t pointIdx)
+{
+    vec2* lineStart = vertexAt(map, lineIndices[0]);
+    vec2* lineEnd = vertexAt(map, lineIndices[1]);
+
+    vec2* point = vertexAt(map, pointIdx);
+
+    vec2 pointVec{ point->x - lineStart->x, point->y - lineStart->y };
+    vec2 lineVec{ lineEnd->x - lineStart->x, lineEnd->y - lineStart->y };
+
+    return lineVec.x * pointVec.y > lineVec.y * pointVec.x;
+}
+
+// 1 in front of the line, -1 behind it, 0 on it or closer to it than snapDistance times its length, with a
+// snapDistance of 0 only the points that are exactly on it
+int32_t pointSide(Map* map, uint32_t* lineIndices, uint32_t pointIdx)
+{
+    if (pointIdx == lineIndices[0] || pointIdx == lineIndices[1])
+        return 0;
+
+    vec2* lineStart = vertexAt(map, lineIndices[0]);
+    vec2* lineEnd = vertexAt(map, lineIndices[1]);
+
+    double orientation = orient2d(lineStart, lineEnd, vertexAt(map, pointIdx));
+
+    // the orientation is the distance to the line times the line's length
+    double lineX = (double)lineEnd->x - lineStart->x;
+    double lineY = (double)lineEnd->y - lineStart->y;
+    double snapDistance = buildOptions.snapDistance * sqrt((lineX * lineX) + (lineY * lineY));
+
+    if (fabs(orientation) <= snapDistance)
+        return 0;
+
+    return orientation > 0.0 ? 1 : -1;
+}
+
+// cross(b - a, p - a) with the right sign, the plain double evaluation is used when it's further from zero
+// than its error bound, otherwise it's redone exactly, this is Shewchuk's adaptive orient2d minus the
+// intermediate stages, the exact one is rarely needed
+double orient2d(vec2* a, vec2* b, vec2* p)
+{
+    double detLeft = ((double)b->x - a->x) * ((double)p->y - a->y);
+    double detRight = ((double)b->y - a->y) * ((double)p->x - a->x);
+    double det = detLeft - detRight;
+
+    double errorBound = ORIENT_ERROR_BOUND * (fabs(detLeft) + fabs(detRight));
+    if (det > errorBound || -det > errorBound)
+        return det;
+
+    return orient2dExact(a, b, p);
+}
+
+// every difference is split into its rounded value and the rounding error, so the determinant is the exact sum
+// of the 16 products of those, the sum is kept as a non overlapping expansion, its largest component has the
+// sign of the whole sum
+double orient2dExact(vec2* a, vec2* b, vec2* p)
+{
+    double lineX[2], lineY[2], pointX[2], pointY[2];
+    twoDiff(b->x, a->x, lineX, lineX + 1);
+    twoDiff(b->y, a->y, lineY, lineY + 1);
+    twoDiff(p->x, a->x, pointX, pointX + 1);
+    twoDiff(p->y, a->y, pointY, pointY + 1);
+
+    double terms[MAX_ORIENT_TERMS];
+    uint32_t numTerms = 0;
+    for (uint32_t lineIdx = 0; lineIdx < 2; ++lineIdx)
+    {
+        for (uint32_t pointIdx = 0; pointIdx < 2; ++pointIdx)
+        {
+            twoProduct(lineX[lineIdx], pointY[pointIdx], terms + numTerms, terms + numTerms + 1);
+            twoProduct(-lineY[lineIdx], pointX[pointIdx], terms + numTerms + 2, terms + numTerms + 3);
+            numTerms += 4;
+        }
+    }
+
+    // grow the expansion by one term at a time, dropping the zero components, it never gets longer than the terms
+    double expansion[MAX_ORIENT_TERMS + 1];
+    uint32_t expansionLength = 0;
+    for (uint32_t termIdx = 0; termIdx < numTerms; ++termIdx)
+    {
+        double sum = terms[termIdx];
+        uint32_t newLength = 0;
+        for (uint32_t componentIdx = 0; componentIdx < expansionLength; ++componentIdx)
+        {
+            double error;
+            twoSum(sum, expansion[componentIdx], &sum, &error);
+            if (error != 0.0)
+                expansion[newLength++] = error;
+        }
+
+        if (sum != 0.0)
+            expansion[newLength++] = sum;
+
+        expansionLength = newLength;
+    }
+
+    return expansionLength > 0 ? expansion[expansionLength - 1] : 0.0;
+}
+
+void twoSum(double a, double b, double* sum, double* error)
+{
+    *sum = a + b;
+    double bVirtual = *sum - a;
+    double aVirtual = *sum - bVirtual;
+    *error = (a - aVirtual) + (b - bVirtual);
+}
+
+void twoDiff(double a, double b, double* diff, double* error)
+{
+    *diff = a - b;
+    double bVirtual = a - *diff;
+    double aVirtual = *diff + bVirtual;
+    *error = (a - aVirtual) + (bVirtual - b);
+}
+
+// the fused multiply add rounds only once, so it gives back exactly what the product lost
+void twoProduct(double a, double b, double* product, double* error)
+{
+    *product = a * b;
+    *error = fma(a, b, -*product);
+}
+
+// the original intersection, through the slope intercept forms of both lines
+vec2 intersectSlopes(vec2* splitterStart, vec2* splitterEnd, vec2* lineStart, vec2* lineEnd)
+{
+    float splitterRise = splitterEnd->y - splitterStart->y;
+    float splitterRun = splitterEnd->x - splitterStart->x;
+    float splitterSlope = splitterRise / splitterRun;
+
+    float lineRise = lineEnd->y - lineStart->y;
+    float lineRun = lineEnd->x - lineStart->x;
+    float lineSlope = lineRise / lineRun;
+
+    float slope;
+    vec2* start;
+
+    float intersectionX;
+    if (splitterRun == 0.f)
+    {
+        slope = lineSlope;
+        start = lineStart;
+        intersectionX = splitterStart->x;
+    }
+    else if (lineRun == 0.f)
+    {
+        slope = splitterSlope;
+        start = splitterStart;
+        intersectionX = lineStart->x;
+    }
+    else
+    {
+        slope = splitterSlope;
+        start = splitterStart;
+
+        intersectionX = ((splitterStart->y - (splitterSlope * splitterStart->x)) -
+                         (lineStart->y - (lineSlope * lineStart->x))) /
+                        (lineSlope - splitterSlope);
+    }
+
+    float intersectionY = (slope * (intersectionX - start->x)) + start->y;
+    return { intersectionX, intersectionY };
+}
+
+// the line's ends are on different sides, so their orientations have different signs and the intersection
+// is where the orientation, linear along the line, gets to zero, no slopes involved, so vertical lines are fine
+vec2 intersectParametric(vec2* splitterStart, vec2* splitterEnd, vec2* lineStart, vec2* lineEnd)
+{
+    double startOrientation = orient2d(splitterStart, splitterEnd, lineStart);
+    double endOrientation = orient2d(splitterStart, splitterEnd, lineEnd);
+
+    double t = startOrientation / (startOrientation - endOrientation);
+    t = t < 0.0 ? 0.0 : (t > 1.0 ? 1.0 : t);
+
+    return { (float)(lineStart->x + (t * ((double)lineEnd->x - lineStart->x))),
+             (float)(lineStart->y + (t * ((double)lineEnd->y - lineStart->y))) };
+}
+
+void* arenaAlloc(Arena* arena, size_t size)
+{
+    size = (size + ARENA_ALIGNMENT - 1) & ~(ARENA_ALIGNMENT - 1);
+
+    if (arrlenu(arena->blocks) == 0 || arena->used + size > arena->blocks[arena->currentBlock].size)
+    {
+        ArenaBlock block;
+        block.size = size > ARENA_BLOCK_SIZE ? size : ARENA_BLOCK_SIZE;
+        block.memory = new uint8_t[block.size];
+        arrput(arena->blocks, block);
+
+        arena->currentBlock = (uint32_t)arrlenu(arena->blocks) - 1;
+        arena->used = 0;
+    }
+
+    void* memory = arena->blocks[arena->currentBlock].memory + arena->used;
+    arena->used += size;
+    return memory;
+}
+
+// memory that ends where the arena's current block ends just takes more of the block, when it fits, memory from
+// outside the arena is only as big as it says, so only that much is copied
+void* arenaGrow(Arena* arena, void* memory, size_t size, size_t newSize)
+{
+    size_t copySize = size;
+    size = (size + ARENA_ALIGNMENT - 1) & ~(ARENA_ALIGNMENT - 1);
+    newSize = (newSize + ARENA_ALIGNMENT - 1) & ~(ARENA_ALIGNMENT - 1);
+
+    if (arrlenu(arena->blocks) > 0)
+    {
+        ArenaBlock* block = arena->blocks + arena->currentBlock;
+        if ((uint8_t*)memory + size == block->memory + arena->used && arena->used - size + newSize <= block->size)
+        {
+            arena->used += newSize - size;
+            return memory;
+        }
+    }
+
+    void* grownMemory = arenaAlloc(arena, newSize);
+    memcpy(grownMemory, memory, copySize);
+    return grownMemory;
+}
+
+// the vertex (and its chunk) is written before its index is handed out, so any thread that knows the index
+// can read it without taking the lock
+uint32_t addVertex(Map* map, vec2 vertex)
+{
+    std::lock_guard<std::mutex> lock(map->verticesMutex);
+
+    uint32_t weldedVertex;
+    if (buildOptions.weldEpsilon > 0.f && findWeldVertex(map, vertex, &weldedVertex))
+        return weldedVertex;
+
+    return appendVertex(map, vertex);
+}
+
+// a new vertex even when there's one within weldEpsilon, the caller holds the vertices lock
+uint32_t appendVertex(Map* map, vec2 vertex)
+{
+    if ((map->numVertices >> VERTEX_CHUNK_SHIFT) == map->numVertexChunks)
+        addVertexChunk(map);
+
+    *vertexAt(map, map->numVertices) = vertex;
+
+    if (buildOptions.weldEpsilon > 0.f)
+        insertWeldVertex(map, map->numVertices);
+
+    return map->numVertices++;
+}
+
+vec2* addVertexChunk(Map* map)
+{
+    if (map->numVertexChunks == MAX_VERTEX_CHUNKS)
+    {
+        puts("Too many vertices");
+        exit(1);
+    }
+
+    vec2* chunk = new vec2[VERTEX_CHUNK_SIZE];
+    map->vertexChunks[map->numVertexChunks++] = chunk;
+    return chunk;
+}
+
+// the closest vertex within weldEpsilon, a vertex that close is always in one of the 3x3 cells around the point
+bool findWeldVertex(Map* map, vec2 vertex, uint32_t* vertexIdx)
+{
+    WeldTable* table = &map->weldTable;
+    float maxDistanceSq = buildOptions.weldEpsilon * buildOptions.weldEpsilon;
+    int64_t cellX = (int64_t)floorf(vertex.x / buildOptions.weldEpsilon);
+    int64_t cellY = (int64_t)floorf(vertex.y / buildOptions.weldEpsilon);
+
+    *vertexIdx = NO_VERTEX;
+    for (int64_t offsetY = -1; offsetY <= 1 && table->capacity > 0; ++offsetY)
+    {
+        for (int64_t offsetX = -1; offsetX <= 1; ++offsetX)
+        {
+            uint64_t cellKey = weldCellKey(cellX + offsetX, cellY + offsetY);
+            uint32_t cellIdx = findWeldCell(table, cellKey);
+            if (table->cellKeys[cellIdx] != cellKey)
+                continue;
+
+            for (uint32_t other = table->cellHeads[cellIdx]; other != NO_VERTEX; other = table->nextInCell[other])
+            {
+                vec2* otherVertex = vertexAt(map, other);
+                vec2 delta = { otherVertex->x - vertex.x, otherVertex->y - vertex.y };
+
+                float distanceSq = dot(&delta, &delta);
+                if (distanceSq <= maxDistanceSq)
+                {
+                    maxDistanceSq = distanceSq;
+                    *vertexIdx = other;
+                }
+            }
+        }
+    }
+
+    return *vertexIdx != NO_VERTEX;
+}
+
+void insertWeldVertex(Map* map, uint32_t vertexIdx)
+{
+    WeldTable* table = &map->weldTable;
+
+    // keep the table at most half full
+    if ((table->numCells + 1) * 2 > table->capacity)
+    {
+        WeldTable biggerTable;
+        biggerTable.capacity = table->capacity ? table->capacity * 2 : 1024;
+        biggerTable.cellKeys = new uint64_t[biggerTable.capacity];
+        biggerTable.cellHeads = new uint32_t[biggerTable.capacity];
+
+        for (uint32_t cellIdx = 0; cellIdx < biggerTable.capacity; ++cellIdx)
+            biggerTable.cellKeys[cellIdx] = EMPTY_WELD_CELL;
+
+        for (uint32_t cellIdx = 0; cellIdx < table->capacity; ++cellIdx)
+        {
+            if (table->cellKeys[cellIdx] == EMPTY_WELD_CELL)
+                continue;
+
+            uint32_t biggerCellIdx = findWeldCell(&biggerTable, table->cellKeys[cellIdx]);
+            biggerTable.cellKeys[biggerCellIdx] = table->cellKeys[cellIdx];
+            biggerTable.cellHeads[biggerCellIdx] = table->cellHeads[cellIdx];
+        }
+
+        delete[] table->cellKeys;
+        delete[] table->cellHeads;
+
+        table->cellKeys = biggerTable.cellKeys;
+        table->cellHeads = biggerTable.cellHeads;
+        table->capacity = biggerTable.capacity;
+    }
+
+    vec2* vertex = vertexAt(map, vertexIdx);
+    uint64_t cellKey = weldCellKey((int64_t)floorf(vertex->x / buildOptions.weldEpsilon),
+                                   (int64_t)floorf(vertex->y / buildOptions.weldEpsilon));
+
+    uint32_t cellIdx = findWeldCell(table, cellKey);
+    if (table->cellKeys[cellIdx] == EMPTY_WELD_CELL)
+    {
+        table->cellKeys[cellIdx] = cellKey;
+        table->cellHeads[cellIdx] = NO_VERTEX;
+        ++table->numCells;
+    }
+
+    arrsetlen(table->nextInCell, vertexIdx + 1);
+    table->nextInCell[vertexIdx] = table->cellHeads[cellIdx];
+    table->cellHeads[cellIdx] = vertexIdx;
+}
+
+uint64_t weldCellKey(int64_t cellX, int64_t cellY) { return ((uint64_t)(uint32_t)cellX << 32) | (uint32_t)cellY; }
+
+// linear probing, stops at the cell with that key or at the empty slot it would go into
+uint32_t findWeldCell(WeldTable* table, uint64_t cellKey)
+{
+    uint32_t cellIdx = (uint32_t)((cellKey * 0x9E3779B97F4A7C15ull) >> 32) & (table->capacity - 1);
+    while (table->cellKeys[cellIdx] != EMPTY_WELD_CELL && table->cellKeys[cellIdx] != cellKey)
+        cellIdx = (cellIdx + 1) & (table->capacity - 1);
+
+    return cellIdx;
+}
+
+// the nodes go out breadth first, so the children of an inner node come one after the other, every leaf
+// gets the next leaf index and its lines go right behind the previous leaf's, the whole file is put together
+// in memory first, as the checksum in the header covers everything behind it
+void writeToFile(Map* map, BSPNode* root, vec2* sourceLines, uint32_t numSourceIndices, FILE* file)
+{
+    BSPNode** queue = NULL;
+    BSPFileNode* nodes = NULL;
+    BSPBounds* bounds = NULL;
+    BSPFileLeaf* leaves = NULL;
+    uint32_t* segments = NULL;
+    uint32_t* lineSources = NULL;
+    vec3* colors = NULL;
+    BSPFileWall* walls = NULL;
+    uint32_t* splitters = NULL;
+
+    arrput(queue, root);
+    for (uint32_t nodeIdx = 0; nodeIdx < arrlenu(queue); ++nodeIdx)
+    {
+        BSPNode* current = queue[nodeIdx];
+        BSPFileNode fileNode = {};
+        uint32_t splitter[2] = {};
+
+        if (current->isLeaf)
+        {
+            BSPFileLeaf leaf;
+            leaf.firstIndex = (uint32_t)arrlenu(segments);
+            leaf.numIndices = current->data.lines->numIndices;
+
+            fileNode.children = BSP_LEAF_NODE | (uint32_t)arrlenu(leaves);
+            arrput(leaves, leaf);
+
+            for (uint32_t pointIdx = 0; pointIdx < current->data.lines->numIndices; ++pointIdx)
+                arrput(segments, current->data.lines->verticesIndecies[pointIdx]);
+
+            for (uint32_t lineIdx = 0; lineIdx < current->data.lines->numIndices / 2u; ++lineIdx)
+                arrput(lineSources, current->data.lines->sources[lineIdx]);
+
+            for (uint32_t lineIdx = 0; lineIdx < current->data.lines->numIndices; lineIdx += 2)
+            {
+                uint32_t* lineIndices = current->data.lines->verticesIndecies + lineIdx;
+                vec2* lineStart = vertexAt(map, lineIndices[0]);
+                vec2* lineEnd = vertexAt(map, lineIndices[1]);
+
+                BSPFileWall wall;
+                wall.start = *lineStart;
+                wall.direction = { lineEnd->x - lineStart->x, lineEnd->y - lineStart->y };
+                wall.length = sqrtf((wall.direction.x * wall.direction.x) + (wall.direction.y * wall.direction.y));
+                computeLinePlane(map, lineIndices, &wall.normal, &wall.distance);
+                arrput(walls, wall);
+            }
+
+            float color[3];
+            for (uint32_t channelIdx = 0; channelIdx < 3; ++channelIdx)
+            {
+                color[channelIdx] = ((float)(rand() % 255)) / 255.f;
+            }
+            arrput(colors, (vec3{ color[0], color[1], color[2] }));
+        }
+        else
+        {
+            fileNode.children = (uint32_t)arrlenu(queue);
+            computeLinePlane(map, current->splitter, &fileNode.normal, &fileNode.distance);
+            splitter[0] = current->splitter[0];
+            splitter[1] = current->splitter[1];
+
+            arrput(queue, current->data.children->frontChild);
+            arrput(queue, current->data.children->backChild);
+        }
+
+        arrput(nodes, fileNode);
+        arrput(bounds, current->bounds);
+        arrput(splitters, splitter[0]);
+        arrput(splitters, splitter[1]);
+    }
+
+    BSPFileSection sections[] = {
+        { BSP_SECTION_VERTICES, map->numVertices, 0, (uint32_t)(sizeof(vec2) * map->numVertices) },
+        { BSP_SECTION_NODES, (uint32_t)arrlenu(nodes), 0, (uint32_t)(sizeof(BSPFileNode) * arrlenu(nodes)) },
+        { BSP_SECTION_BOUNDS, (uint32_t)arrlenu(bounds), 0, (uint32_t)(sizeof(BSPBounds) * arrlenu(bounds)) },
+        { BSP_SECTION_LEAVES, (uint32_t)arrlenu(leaves), 0, (uint32_t)(sizeof(BSPFileLeaf) * arrlenu(leaves)) },
+        { BSP_SECTION_SEGMENTS, (uint32_t)arrlenu(segments), 0, (uint32_t)(sizeof(uint32_t) * arrlenu(segments)) },
+        { BSP_SECTION_COLORS, (uint32_t)arrlenu(colors), 0, (uint32_t)(sizeof(vec3) * arrlenu(colors)) },
+        { BSP_SECTION_WALLS, (uint32_t)arrlenu(walls), 0, (uint32_t)(sizeof(BSPFileWall) * arrlenu(walls)) },
+        { BSP_SECTION_SPLITTERS, (uint32_t)arrlenu(splitters), 0, (uint32_t)(sizeof(uint32_t) * arrlenu(splitters)) },
+        { BSP_SECTION_SOURCE_LINES, numSourceIndices, 0, (uint32_t)(sizeof(vec2) * numSourceIndices) },
+        { BSP_SECTION_LINE_SOURCES, (uint32_t)arrlenu(lineSources), 0,
+          (uint32_t)(sizeof(uint32_t) * arrlenu(lineSources)) },
+    };
+    const void* sectionData[] = { nullptr, nodes, bounds, leaves, segments, colors, walls, splitters, sourceLines,
+                                  lineSources };
+    const uint32_t numSections = sizeof(sections) / sizeof(BSPFileSection);
+
+    uint32_t fileSize = sizeof(BSPFileHeader) + sizeof(sections);
+    for (uint32_t sectionIdx = 0; sectionIdx < numSections; ++sectionIdx)
+    {
+        sections[sectionIdx].offset = (fileSize + BSP_FILE_ALIGNMENT - 1) & ~(BSP_FILE_ALIGNMENT - 1);
+        fileSize = sections[sectionIdx].offset + sections[sectionIdx].size;
+    }
+    fileSize = (fileSize + BSP_FILE_ALIGNMENT - 1) & ~(BSP_FILE_ALIGNMENT - 1);
+
+    uint8_t* fileData = new uint8_t[fileSize];
+    memset(fileData, 0, fileSize);
+    memcpy(fileData + sizeof(BSPFileHeader), sections, sizeof(sections));
+
+    // the vertices are still in their chunks
+    for (uint32_t chunkIdx = 0; chunkIdx < map->numVertexChunks; ++chunkIdx)
+    {
+        uint32_t numChunkVertices = map->numVertices - (chunkIdx << VERTEX_CHUNK_SHIFT);
+        numChunkVertices = numChunkVertices > VERTEX_CHUNK_SIZE ? VERTEX_CHUNK_SIZE : numChunkVertices;
+        memcpy(fileData + sections[0].offset + (sizeof(vec2) * (chunkIdx << VERTEX_CHUNK_SHIFT)),
+               map->vertexChunks[chunkIdx], sizeof(vec2) * numChunkVertices);
+    }
+
+    for (uint32_t sectionIdx = 1; sectionIdx < numSections; ++sectionIdx)
+        memcpy(fileData + sections[sectionIdx].offset, sectionData[sectionIdx], sections[sectionIdx].size);
+
+    BSPFileHeader header;
+    memcpy(header.magic, BSP_FILE_MAGIC, sizeof(header.magic));
+    header.version = BSP_FILE_VERSION;
+    header.numSections = numSections;
+    header.checksum = computeChecksum(fileData + sizeof(BSPFileHeader), fileSize - sizeof(BSPFileHeader));
+    memcpy(fileData, &header, sizeof(BSPFileHeader));
+
+    fwrite(fileData, 1, fileSize, file);
+
+    delete[] fileData;
+    arrfree(queue);
+    arrfree(nodes);
+    arrfree(bounds);
+    arrfree(leaves);
+    arrfree(segments);
+    arrfree(colors);
+    arrfree(walls);
+    arrfree(splitters);
+    arrfree(lineSources);
+}
+
+// the line's left hand normal, so it matches isPointInFront(), done in double as the renderer only sees the result
+void computeLinePlane(Map* map, uint32_t* lineIndices, vec2* normal, float* distance)
+{
+    vec2* lineStart = vertexAt(map, lineIndices[0]);
+    vec2* lineEnd = vertexAt(map, lineIndices[1]);
+
+    double normalX = -((double)lineEnd->y - lineStart->y);
+    double normalY = (double)lineEnd->x - lineStart->x;
+    double length = sqrt((normalX * normalX) + (normalY * normalY));
+
+    // a degenerate line keeps the zero normal, everything is behind it, same as with the cross product
+    if (length > 0.0)
+    {
+        normalX /= length;
+        normalY /= length;
+    }
+
+    normal->x = (float)normalX;
+    normal->y = (float)normalY;
+    *distance = (float)((normalX * lineStart->x) + (normalY * lineStart->y));
+}
+
+// crc32 (the zlib one), the table is built on first use
+uint32_t computeChecksum(const uint8_t* data, size_t size)
+{
+    static uint32_t table[256];
+    static bool isTableReady = false;
+
+    if (!isTableReady)
+    {
+        for (uint32_t byte = 0; byte < 256; ++byte)
+        {
+            uint32_t crc = byte;
+            for (uint32_t bitIdx = 0; bitIdx < 8; ++bitIdx)
+                crc = (crc & 1) ? (crc >> 1) ^ 0xEDB88320u : crc >> 1;
+            table[byte] = crc;
+        }
+        isTableReady = true;
+    }
+
+    uint32_t crc = ~0u;
+    for (size_t byteIdx = 0; byteIdx < size; ++byteIdx)
+        crc = table[(crc ^ data[byteIdx]) & 0xFF] ^ (crc >> 8);
+
+    return ~crc;
 }
\ No newline at end of file
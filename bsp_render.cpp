@@ -1,14 +1,29 @@
-#define FRONT_CHILD(node) ((BSPNode*)(((uint8_t*)node) + node->data.children.frontChildOffset))
-#define BACK_CHILD(node) ((BSPNode*)(((uint8_t*)node) + node->data.children.backChildOffset))
 #define RAD(angle) ((angle)*M_PI / 180.0)
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <time.h>
 #include <stdlib.h>
+#include <string.h>
 #include <math.h>
 #include <iostream>
 #include <fstream>
+#include <chrono>
+#include <algorithm>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+#if defined(_WIN32)
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
 
 #include "GL/glew.h"
 #include "SDL2/SDL.h"
@@ -27,6 +42,17 @@
 
 #include <cstdint>
 
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define BSP_X86
+#include <immintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#define BSP_TARGET_AVX
+#else
+#define BSP_TARGET_AVX __attribute__((target("avx")))
+#endif
+#endif
+
 #define LEFT_CHILD(node) (((uint32*)node) + 10)
 #define LEFT_CHILD(node) (((uint32*)node) + 10)
 
@@ -36,6 +62,16 @@ static const uint16_t WINDOW_HEIGHT = 800;
 static const float WINDOW_WIDTH_F = 800.f;
 static const float WINDOW_HEIGHT_F = 800.f;
 static const float WALL_DIVIDE_CONST = 30000.f;
+static const float NEAR_DEPTH = 0.001f;
+static const uint32_t MAX_KERNEL_WIDTH = 8;
+static const uint32_t NUM_UPLOAD_BUFFERS = 3;
+static const uint16_t MAX_RENDER_WIDTH = 4096;
+static const uint16_t MAX_RENDER_HEIGHT = 4096;
+static const char BSP_FILE_MAGIC[4] = { 'B', 'S', 'P', 'M' };
+static const uint32_t BSP_FILE_VERSION = 4;
+static const uint32_t BSP_FILE_ALIGNMENT = 16;
+static const uint32_t BSP_LEAF_NODE = 1u << 31;
+static const float NO_HIT = 2.f; // past the end of every ray
 
 
 struct vec2
@@ -58,41 +94,82 @@ GLuint basicShader;
 GLuint quadVAO, quadVBO;
 GLuint positionsBuffer, indicesBuffer, colorsBuffer;
 
-#pragma pack(push, 1)
-
-struct BSPLines
+struct BSPBounds
 {
-    vec3 wallColor;
-    uint16_t numElements = 0;
-    uint32_t elements[];
+    vec2 min;
+    vec2 max;
 };
 
-struct BSPNode;
+// the compiled map, see bsp_creator.cpp for the file format
+struct BSPFileHeader
+{
+    char magic[4];
+    uint32_t version;
+    uint32_t numSections;
+    uint32_t checksum; // of everything after the header
+};
 
-struct BSPChildren
+struct BSPFileSection
 {
-    uint32_t splitter[2];
-    uint32_t frontChildOffset;
-    uint32_t backChildOffset;
+    uint32_t type;
+    uint32_t count;
+    uint32_t offset;
+    uint32_t size;
 };
 
-union BSPData {
-    BSPChildren children;
-    BSPLines lines;
+enum BSPSectionType
+{
+    BSP_SECTION_VERTICES = 1,
+    BSP_SECTION_NODES,
+    BSP_SECTION_BOUNDS,
+    BSP_SECTION_LEAVES,
+    BSP_SECTION_SEGMENTS,
+    BSP_SECTION_COLORS,
+    BSP_SECTION_WALLS,
+    NUM_BSP_SECTION_TYPES,
 };
 
+// nodes are in breadth first order, the back child of an inner node always directly follows its front child,
+// the splitter is stored as a plane, so picking the near child doesn't have to touch the vertices
 struct BSPNode
 {
-    bool isLeaf;
-    BSPData data;
+    vec2 normal;       // inner nodes only, points to the front side
+    float distance;    // inner nodes only
+    uint32_t children; // index of the front child for inner nodes, BSP_LEAF_NODE | leaf index for leaves
+};
+
+struct BSPLeaf
+{
+    uint32_t firstIndex; // into the segments, the leaf's first wall is firstIndex / 2
+    uint32_t numIndices;
+};
+
+// one per leaf line, the same line equation as the nodes, so drawing a wall doesn't touch the vertices
+struct BSPWall
+{
+    vec2 start;
+    vec2 direction; // end - start
+    vec2 normal;
+    float distance;
+    float length;
 };
-#pragma pack(pop)
 
+// the compiled map is mapped read only, all the arrays point straight into the mapping
 struct Map
 {
     uint32_t numVertices;
+    uint32_t numNodes;
+    uint32_t numLeaves;
+    uint32_t numSegmentIndices;
     vec2* vertices;
-    BSPNode* root;
+    BSPNode* nodes;
+    BSPBounds* bounds; // per node
+    BSPLeaf* leaves;
+    uint32_t* segments;
+    vec3* colors; // per leaf
+    BSPWall* walls;
+    void* mapping;
+    size_t mappingSize;
 };
 
 struct Player
@@ -104,13 +181,169 @@ struct Player
     vec2 pos;
 };
 
-bool isPointInFront(Map* map, uint32_t* lineIndices, vec2* pos);
+// per frame camera data shared by the whole BSP traversal, so the leaves don't have to do any trigonometry
+struct RayTable
+{
+    vec2 forward;                   // direction the player is looking at
+    vec2 leftEdge;                  // direction of the left frustum edge (column 0)
+    vec2 rightEdge;                 // direction of the right frustum edge
+    float halfFov;                  // in radians
+    float columnsPerRadian;
+    uint16_t numColumns;            // render resolution of the frame
+    uint16_t numRows;
+    float wallScale;                // height of a wall at distance 1, in rows
+    float rayDepths[MAX_RENDER_WIDTH]; // projection of each ray onto forward, used to get the perpendicular distance
+
+    // ray of each column, already scaled by the view distance, split into x and y so the intersection
+    // kernels can load a few columns at once, padded so the last load of a row stays in bounds
+    alignas(32) float rayX[MAX_RENDER_WIDTH + MAX_KERNEL_WIDTH];
+    alignas(32) float rayY[MAX_RENDER_WIDTH + MAX_KERNEL_WIDTH];
+};
+
+// wall vs. column rays test, intersects the rays of the columns [x, x + width) with the wall
+// and returns a mask with a bit set for every ray that hits, the ray parameters of the hits go to t
+// s is the wall vector and toRayStart goes from the wall start to the player
+typedef uint32_t (*IntersectFn)(RayTable* rays, uint16_t x, vec2* s, vec2* toRayStart, float* t);
+
+struct IntersectKernel
+{
+    const char* name;
+    uint32_t width;
+    IntersectFn intersect;
+};
+
+// tracks which columns already have a wall drawn in them, the traversal goes front to back so the first leaf
+// hit in a column has the visible wall and the column can be skipped afterwards, the walls of one leaf can still
+// hide each other, so the leaf's nearest hit per column is kept until all of its walls are tested
+struct alignas(64) ColumnClip
+{
+    uint16_t numColumns;
+    uint16_t numOpenColumns;
+    uint16_t nextOpen[MAX_RENDER_WIDTH + 1]; // first open column at or after the index, numColumns is the sentinel
+    uint16_t numHitColumns;
+    uint16_t hitColumns[MAX_RENDER_WIDTH]; // open columns the current leaf hit
+    float nearestT[MAX_RENDER_WIDTH];      // of the current leaf, NO_HIT for the columns it didn't hit
+};
 
-static vec3 outputPPM[WINDOW_WIDTH][WINDOW_HEIGHT];
+// internal render resolution, the frame is stretched over the window by the quad pass
+// width is the number of columns rendered and is lowered/raised by the dynamic resolution when there's
+// a frame budget, height is the stride of a column in outputPPM so it stays fixed after startup
+struct Resolution
+{
+    uint16_t width = WINDOW_WIDTH;
+    uint16_t height = WINDOW_HEIGHT;
+    uint16_t maxWidth = WINDOW_WIDTH;
+    float frameBudget = 0.f;      // in ms, 0 turns the dynamic resolution off
+    float averageFrameTime = 0.f; // moving average of the render time in ms
+};
 
-bool render(Map* map, BSPNode* node, Player* player);
+// persistent workers rendering the frame in vertical strips, columns don't depend on each other
+// so every thread walks the whole tree with its own clip buffer and writes only its own columns
+// the calling thread renders the first strip, so numThreads == 1 means no workers at all
+struct RenderPool
+{
+    uint32_t numThreads = 0;
+    std::thread* workers = nullptr;
+    ColumnClip* clips = nullptr;
+
+    std::mutex mutex;
+    std::condition_variable frameStarted;
+    std::condition_variable frameFinished;
+    uint64_t frameIdx = 0;
+    uint32_t numPendingStrips = 0;
+    bool isShuttingDown = false;
+
+    Map* map = nullptr;
+    Player* player = nullptr;
+    RayTable* rays = nullptr;
+};
+
+enum UploadMode
+{
+    UPLOAD_CLIENT_MEMORY,   // glTexSubImage2D straight from frameBuffer
+    UPLOAD_MAPPED_PBO,      // render into a pixel buffer mapped for the frame, then upload from it
+    UPLOAD_PERSISTENT_PBO,  // render into persistently mapped pixel buffers, fenced so the GPU is done with them
+};
+
+// the frame is rendered straight into GPU visible memory when pixel buffers are available,
+// the buffers rotate so the upload of one frame overlaps with rendering the next one
+struct FrameUpload
+{
+    UploadMode mode = UPLOAD_CLIENT_MEMORY;
+    size_t bufferSize = 0;
+    uint32_t currentBuffer = 0;
+    GLuint buffers[NUM_UPLOAD_BUFFERS] = {};
+    GLsync fences[NUM_UPLOAD_BUFFERS] = {};
+    uint32_t* mappings[NUM_UPLOAD_BUFFERS] = {};
+};
+
+struct CameraKey
+{
+    vec2 pos;
+    float angle;
+};
+
+inline uint32_t packColor(vec3* color);
+
+// packed RGBA8, column after column so a wall's vertical span is one contiguous run of memory
+// outputPPM is where the current frame goes, either frameBuffer or a mapped pixel buffer
+static Resolution resolution;
+static uint32_t* frameBuffer = nullptr;
+static uint32_t* outputPPM = nullptr;
+
+static RenderPool renderPool;
+static IntersectKernel intersectKernel;
+
+static char manual[] = "Usage: bsp_render <compiled-map-file> [--threads <num-threads>] [--kernel scalar|sse|avx] "
+                       "[--resolution <width>x<height>] [--frame-budget <ms>] "
+                       "[--benchmark <num-frames> <output-ppm-file> [--scaling]]";
+
+bool loadMap(Map* map, const char* mapFilePath);
+void unloadMap(Map* map);
+void* mapSection(Map* map, BSPFileSection* section, uint32_t elementSize, uint32_t* count);
+uint32_t computeChecksum(const uint8_t* data, size_t size);
+void* mapFile(const char* filePath, size_t* fileSize);
+void unmapFile(void* mapping, size_t mappingSize);
+void renderFrame(Map* map, Player* player);
+void initFrameUpload(FrameUpload* upload);
+void destroyFrameUpload(FrameUpload* upload);
+void beginFrameUpload(FrameUpload* upload);
+void endFrameUpload(FrameUpload* upload, uint16_t numColumns);
+void updateDynamicResolution(Resolution* res, float frameTime);
+inline uint32_t* frameColumn(uint16_t x);
+void initRenderPool(RenderPool* pool, uint32_t numThreads);
+void destroyRenderPool(RenderPool* pool);
+void renderPoolWorker(RenderPool* pool, uint32_t stripIdx);
+void renderStrip(RenderPool* pool, uint32_t stripIdx);
+void buildRayTable(RayTable* rays, Player* player, Resolution* res);
+void resetColumnClip(ColumnClip* clip, uint16_t firstColumn, uint16_t lastColumn, uint16_t numColumns);
+uint16_t nextOpenColumn(ColumnClip* clip, uint16_t x);
+void closeColumn(ColumnClip* clip, uint16_t x);
+bool pickIntersectKernel(IntersectKernel* kernel, const char* name);
+uint32_t intersectScalar(RayTable* rays, uint16_t x, vec2* s, vec2* toRayStart, float* t);
+#ifdef BSP_X86
+uint32_t intersectSSE(RayTable* rays, uint16_t x, vec2* s, vec2* toRayStart, float* t);
+BSP_TARGET_AVX uint32_t intersectAVX(RayTable* rays, uint16_t x, vec2* s, vec2* toRayStart, float* t);
+bool isAVXSupported();
+#endif
+inline uint32_t lowestSetBit(uint32_t mask);
+bool segmentColumnRange(BSPWall* wall, Player* player, RayTable* rays, uint16_t* firstColumn, uint16_t* lastColumn);
+bool isBoundsVisible(BSPBounds* bounds, Player* player, RayTable* rays);
+bool render(Map* map, uint32_t nodeIdx, Player* player, RayTable* rays, ColumnClip* clip);
+int runBenchmark(Map* map, Player* player, uint32_t numFrames, uint32_t numThreads, bool scaling,
+                 const char* outputPath);
+void benchmarkCameraPath(Map* map, Player* player, uint32_t numFrames, double* frameTimes);
+bool writePPM(const char* outputPath);
 inline float cross(vec2* a, vec2* b);
 
+// scripted camera path used by the benchmark, the player is interpolated between the keys
+// and the whole path is spread over the requested number of frames
+static CameraKey benchmarkPath[] = {
+    { { 125.f, 125.f }, 90.f },  { { 400.f, 125.f }, 45.f },  { { 675.f, 125.f }, 135.f },
+    { { 675.f, 475.f }, 225.f }, { { 400.f, 300.f }, 405.f }, { { 125.f, 475.f }, 315.f },
+    { { 125.f, 125.f }, 450.f },
+};
+
 
 // position + texCoords
 static float quadData[] = {
@@ -120,43 +353,106 @@ static float quadData[] = {
 
 int main(int argc, char** argv)
 {
+    if (argc < 2)
+    {
+        puts(manual);
+        return 1;
+    }
+
     time_t t;
     srand((unsigned)time(&t));
 
-    wh::SDLContext context;
-    wh::initSDLContext(&context, WINDOW_WIDTH, WINDOW_HEIGHT);
+    Map map;
+    if (!loadMap(&map, argv[1]))
+        return 1;
 
-    glClearColor(0.f, 0.f, 0.f, 1.f);
-    glViewport(0, 0, WINDOW_WIDTH, WINDOW_HEIGHT);
+    Player player;
+    player.fov = 90.f;
+    player.viewDistance = 1000.f;
+    player.pos = { 125.f, 125.f };
+    player.angle = 90.f;
+    player.focalLength = 300.f;
 
-    SDL_Event event;
-    bool isRunning = true;
+    uint32_t numThreads = std::thread::hardware_concurrency();
+    char* kernelName = nullptr;
+    uint32_t numBenchmarkFrames = 0;
+    char* benchmarkOutputPath = nullptr;
+    bool benchmarkScaling = false;
 
-    Map map;
-    FILE* mapFile = fopen(argv[1], "rb");
+    for (int argIdx = 2; argIdx < argc; ++argIdx)
+    {
+        if (strcmp(argv[argIdx], "--threads") == 0 && argIdx + 1 < argc)
+        {
+            numThreads = (uint32_t)atoi(argv[++argIdx]);
+        }
+        else if (strcmp(argv[argIdx], "--kernel") == 0 && argIdx + 1 < argc)
+        {
+            kernelName = argv[++argIdx];
+        }
+        else if (strcmp(argv[argIdx], "--benchmark") == 0 && argIdx + 2 < argc)
+        {
+            numBenchmarkFrames = (uint32_t)atoi(argv[++argIdx]);
+            benchmarkOutputPath = argv[++argIdx];
+        }
+        else if (strcmp(argv[argIdx], "--scaling") == 0)
+        {
+            benchmarkScaling = true;
+        }
+        else if (strcmp(argv[argIdx], "--resolution") == 0 && argIdx + 1 < argc)
+        {
+            uint32_t width = 0, height = 0;
+            sscanf(argv[++argIdx], "%ux%u", &width, &height);
+
+            if (width < MAX_KERNEL_WIDTH || width > MAX_RENDER_WIDTH || height < 2 || height > MAX_RENDER_HEIGHT)
+            {
+                printf("Render resolution has to be between %ux2 and %ux%u\n", MAX_KERNEL_WIDTH, MAX_RENDER_WIDTH,
+                       MAX_RENDER_HEIGHT);
+                return 1;
+            }
+
+            resolution.width = resolution.maxWidth = (uint16_t)width;
+            resolution.height = (uint16_t)height;
+        }
+        else if (strcmp(argv[argIdx], "--frame-budget") == 0 && argIdx + 1 < argc)
+        {
+            resolution.frameBudget = (float)atof(argv[++argIdx]);
+        }
+        else
+        {
+            puts(manual);
+            return 1;
+        }
+    }
 
-    size_t r = fread(&map, sizeof(uint32_t), 1, mapFile);
-    map.vertices = new vec2[map.numVertices];
-    r = fread(map.vertices, sizeof(vec2), map.numVertices, mapFile);
+    if (!pickIntersectKernel(&intersectKernel, kernelName))
+    {
+        printf("Intersection kernel %s isn't supported on this CPU\n", kernelName);
+        return 1;
+    }
 
-    size_t currentPos = ftell(mapFile);
-    fseek(mapFile, 0, SEEK_END);
-    size_t treeSize = ftell(mapFile) - currentPos;
-    fseek(mapFile, currentPos, SEEK_SET);
+    numThreads = numThreads == 0 ? 1 : numThreads;
+    numThreads = numThreads > resolution.maxWidth ? resolution.maxWidth : numThreads;
 
-    map.root = (BSPNode*)malloc(treeSize);
+    frameBuffer = new uint32_t[resolution.maxWidth * resolution.height];
+    memset(frameBuffer, 0, sizeof(uint32_t) * resolution.maxWidth * resolution.height);
+    outputPPM = frameBuffer;
 
-    fread(map.root, treeSize, 1, mapFile);
-    fclose(mapFile);
+    if (benchmarkOutputPath != nullptr)
+    {
+        return runBenchmark(&map, &player, numBenchmarkFrames, numThreads, benchmarkScaling,
+                            benchmarkOutputPath);
+    }
 
+    initRenderPool(&renderPool, numThreads);
 
-    Player player;
-    player.fov = 90.f;
-    player.viewDistance = 1000.f;
-    player.pos = { 125.f, 125.f };
-    player.angle = 90.f;
-    player.focalLength = 300.f;
+    wh::SDLContext context;
+    wh::initSDLContext(&context, WINDOW_WIDTH, WINDOW_HEIGHT);
 
+    glClearColor(0.f, 0.f, 0.f, 1.f);
+    glViewport(0, 0, WINDOW_WIDTH, WINDOW_HEIGHT);
+
+    SDL_Event event;
+    bool isRunning = true;
 
     GLuint basicShader = wh::compileShader(vertPath, fragPath);
     glUseProgram(basicShader);
@@ -178,15 +474,25 @@ int main(int argc, char** argv)
     glGenTextures(1, &sceneTexture);
     glBindTexture(GL_TEXTURE_2D, sceneTexture);
 
-    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, WINDOW_WIDTH, WINDOW_HEIGHT, 0, GL_RGB, GL_FLOAT, outputPPM);
-    glGenerateMipmap(GL_TEXTURE_2D);
+    // every row of the texture is one column of the frame, the quad's texture coordinates swap them back
+    // the texture is as big as the widest frame, the dynamic resolution only fills a part of it
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, resolution.height, resolution.maxWidth, 0, GL_RGBA, GL_UNSIGNED_BYTE,
+                 outputPPM);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
     glUniform1i(glGetUniformLocation(basicShader, "tex"), 0);
 
+    GLint uvScaleLocation = glGetUniformLocation(basicShader, "uvScale");
+    GLint uvMaxLocation = glGetUniformLocation(basicShader, "uvMax");
+
+    FrameUpload frameUpload;
+    initFrameUpload(&frameUpload);
+
     float dt = 1 / 60.f;
     while (isRunning)
     {
-
-        memset(outputPPM, 0, sizeof(outputPPM));
         while (SDL_PollEvent(&event))
         {
             switch (event.type)
@@ -230,114 +536,946 @@ int main(int argc, char** argv)
             }
         }
 
-        render(&map, map.root, &player);
+        typedef std::chrono::high_resolution_clock Clock;
+
+        beginFrameUpload(&frameUpload);
 
-        glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, WINDOW_WIDTH, WINDOW_HEIGHT, GL_RGB, GL_FLOAT, outputPPM);
+        Clock::time_point frameStart = Clock::now();
+        renderFrame(&map, &player);
+        float frameTime = std::chrono::duration<float, std::milli>(Clock::now() - frameStart).count();
+
+        endFrameUpload(&frameUpload, resolution.width);
+
+        // only the rows of the texture written this frame are stretched over the window,
+        // the half texel inset keeps the linear filter from blending in the stale ones
+        glUniform2f(uvScaleLocation, 1.f, ((float)resolution.width) / resolution.maxWidth);
+        glUniform2f(uvMaxLocation, 1.f, (resolution.width - 0.5f) / resolution.maxWidth);
 
         glClear(GL_COLOR_BUFFER_BIT);
         glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
         SDL_GL_SwapWindow(context.window);
+
+        updateDynamicResolution(&resolution, frameTime);
     }
 
+    destroyFrameUpload(&frameUpload);
+    destroyRenderPool(&renderPool);
+    unloadMap(&map);
+
     SDL_DestroyWindow(context.window);
     SDL_Quit();
     return 0;
 }
 
-bool render(Map* map, BSPNode* node, Player* player)
+bool loadMap(Map* map, const char* mapFilePath)
+{
+    map->mapping = mapFile(mapFilePath, &map->mappingSize);
+    if (map->mapping == nullptr)
+    {
+        printf("Failed to open map file %s\n", mapFilePath);
+        return false;
+    }
+
+    BSPFileHeader* header = (BSPFileHeader*)map->mapping;
+    if (map->mappingSize < sizeof(BSPFileHeader) || memcmp(header->magic, BSP_FILE_MAGIC, sizeof(header->magic)) != 0 ||
+        header->version != BSP_FILE_VERSION)
+    {
+        printf("%s is not a compiled map (version %u), rebuild it with bsp_creator\n", mapFilePath, BSP_FILE_VERSION);
+        unloadMap(map);
+        return false;
+    }
+
+    uint8_t* fileData = (uint8_t*)map->mapping;
+    bool isMapValid =
+    header->numSections <= (map->mappingSize - sizeof(BSPFileHeader)) / sizeof(BSPFileSection) &&
+    computeChecksum(fileData + sizeof(BSPFileHeader), map->mappingSize - sizeof(BSPFileHeader)) == header->checksum;
+
+    // the last section of a type wins, the ones this version doesn't know about are skipped
+    BSPFileSection* sections[NUM_BSP_SECTION_TYPES] = {};
+    BSPFileSection* sectionTable = (BSPFileSection*)(fileData + sizeof(BSPFileHeader));
+    for (uint32_t sectionIdx = 0; isMapValid && sectionIdx < header->numSections; ++sectionIdx)
+    {
+        if (sectionTable[sectionIdx].type < NUM_BSP_SECTION_TYPES)
+            sections[sectionTable[sectionIdx].type] = sectionTable + sectionIdx;
+    }
+
+    if (isMapValid)
+    {
+        uint32_t numBounds, numColors, numWalls;
+        map->vertices = (vec2*)mapSection(map, sections[BSP_SECTION_VERTICES], sizeof(vec2), &map->numVertices);
+        map->nodes = (BSPNode*)mapSection(map, sections[BSP_SECTION_NODES], sizeof(BSPNode), &map->numNodes);
+        map->bounds = (BSPBounds*)mapSection(map, sections[BSP_SECTION_BOUNDS], sizeof(BSPBounds), &numBounds);
+        map->leaves = (BSPLeaf*)mapSection(map, sections[BSP_SECTION_LEAVES], sizeof(BSPLeaf), &map->numLeaves);
+        map->segments =
+        (uint32_t*)mapSection(map, sections[BSP_SECTION_SEGMENTS], sizeof(uint32_t), &map->numSegmentIndices);
+        map->colors = (vec3*)mapSection(map, sections[BSP_SECTION_COLORS], sizeof(vec3), &numColors);
+        map->walls = (BSPWall*)mapSection(map, sections[BSP_SECTION_WALLS], sizeof(BSPWall), &numWalls);
+
+        isMapValid = map->vertices && map->nodes && map->bounds && map->leaves && map->segments && map->colors &&
+                     map->walls && map->numNodes > 0 && numBounds == map->numNodes &&
+                     numColors == map->numLeaves && (size_t)numWalls * 2 == map->numSegmentIndices;
+    }
+
+    if (!isMapValid)
+    {
+        printf("%s is corrupted, rebuild it with bsp_creator\n", mapFilePath);
+        unloadMap(map);
+        return false;
+    }
+
+    return true;
+}
+
+// null when the section is missing, out of the file, misaligned or not made of whole elements
+void* mapSection(Map* map, BSPFileSection* section, uint32_t elementSize, uint32_t* count)
+{
+    *count = 0;
+    if (section == nullptr || section->offset % BSP_FILE_ALIGNMENT != 0 ||
+        (size_t)section->offset + section->size > map->mappingSize ||
+        (size_t)section->count * elementSize != section->size)
+        return nullptr;
+
+    *count = section->count;
+    return (uint8_t*)map->mapping + section->offset;
+}
+
+void unloadMap(Map* map)
 {
-    if (node->isLeaf)
+    unmapFile(map->mapping, map->mappingSize);
+    map->mapping = nullptr;
+    map->vertices = nullptr;
+    map->nodes = nullptr;
+    map->bounds = nullptr;
+    map->leaves = nullptr;
+    map->segments = nullptr;
+    map->colors = nullptr;
+    map->walls = nullptr;
+}
+
+// crc32 (the zlib one), the table is built on first use
+uint32_t computeChecksum(const uint8_t* data, size_t size)
+{
+    static uint32_t table[256];
+    static bool isTableReady = false;
+
+    if (!isTableReady)
     {
-        uint32_t* lines = node->data.lines.elements;
-        for (uint32_t x = 0; x < WINDOW_WIDTH; ++x)
+        for (uint32_t byte = 0; byte < 256; ++byte)
         {
-            for (uint32_t line = 0; line < node->data.lines.numElements; line += 2)
-            {
-                float progress = ((float)x) / WINDOW_WIDTH_F;
-                float degrees = player->angle + (player->fov / 2) - (progress * player->fov);
-                float rayAngle = RAD(degrees);
+            uint32_t crc = byte;
+            for (uint32_t bitIdx = 0; bitIdx < 8; ++bitIdx)
+                crc = (crc & 1) ? (crc >> 1) ^ 0xEDB88320u : crc >> 1;
+            table[byte] = crc;
+        }
+        isTableReady = true;
+    }
+
+    uint32_t crc = ~0u;
+    for (size_t byteIdx = 0; byteIdx < size; ++byteIdx)
+        crc = table[(crc ^ data[byteIdx]) & 0xFF] ^ (crc >> 8);
+
+    return ~crc;
+}
+
+// read only, the pages come straight from the page cache and are shared with every other process using the map
+void* mapFile(const char* filePath, size_t* fileSize)
+{
+#if defined(_WIN32)
+    HANDLE file = CreateFileA(filePath, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE)
+        return nullptr;
+
+    LARGE_INTEGER size;
+    HANDLE mapping = NULL;
+    if (GetFileSizeEx(file, &size) && size.QuadPart > 0)
+        mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+
+    void* view = mapping ? MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0) : NULL;
+
+    // the view keeps the file mapped
+    if (mapping)
+        CloseHandle(mapping);
+    CloseHandle(file);
+
+    *fileSize = (size_t)size.QuadPart;
+    return view;
+#else
+    int file = open(filePath, O_RDONLY);
+    if (file < 0)
+        return nullptr;
+
+    struct stat fileStat;
+    void* mapping = MAP_FAILED;
+    if (fstat(file, &fileStat) == 0 && fileStat.st_size > 0)
+        mapping = mmap(nullptr, (size_t)fileStat.st_size, PROT_READ, MAP_SHARED, file, 0);
+
+    close(file);
+
+    *fileSize = (size_t)fileStat.st_size;
+    return mapping == MAP_FAILED ? nullptr : mapping;
+#endif
+}
+
+void unmapFile(void* mapping, size_t mappingSize)
+{
+    if (mapping == nullptr)
+        return;
+
+#if defined(_WIN32)
+    UnmapViewOfFile(mapping);
+#else
+    munmap(mapping, mappingSize);
+#endif
+}
+
+void renderFrame(Map* map, Player* player)
+{
+    static RayTable rays;
+    buildRayTable(&rays, player, &resolution);
+
+    RenderPool* pool = &renderPool;
+    {
+        std::lock_guard<std::mutex> lock(pool->mutex);
+        pool->map = map;
+        pool->player = player;
+        pool->rays = &rays;
+        pool->numPendingStrips = pool->numThreads - 1;
+        ++pool->frameIdx;
+    }
+    pool->frameStarted.notify_all();
+
+    renderStrip(pool, 0);
+
+    std::unique_lock<std::mutex> lock(pool->mutex);
+    pool->frameFinished.wait(lock, [pool] { return pool->numPendingStrips == 0; });
+}
+
+void initFrameUpload(FrameUpload* upload)
+{
+    upload->bufferSize = sizeof(uint32_t) * resolution.maxWidth * resolution.height;
+
+    if (GLEW_ARB_buffer_storage)
+        upload->mode = UPLOAD_PERSISTENT_PBO;
+    else if (GLEW_ARB_pixel_buffer_object || GLEW_VERSION_2_1)
+        upload->mode = UPLOAD_MAPPED_PBO;
+    else
+        upload->mode = UPLOAD_CLIENT_MEMORY;
+
+    if (upload->mode == UPLOAD_CLIENT_MEMORY)
+        return;
+
+    glGenBuffers(NUM_UPLOAD_BUFFERS, upload->buffers);
+    for (uint32_t bufferIdx = 0; bufferIdx < NUM_UPLOAD_BUFFERS; ++bufferIdx)
+    {
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, upload->buffers[bufferIdx]);
+
+        if (upload->mode == UPLOAD_PERSISTENT_PBO)
+        {
+            GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+            glBufferStorage(GL_PIXEL_UNPACK_BUFFER, upload->bufferSize, nullptr, flags);
+            upload->mappings[bufferIdx] =
+            (uint32_t*)glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, upload->bufferSize, flags);
+        }
+        else
+        {
+            glBufferData(GL_PIXEL_UNPACK_BUFFER, upload->bufferSize, nullptr, GL_STREAM_DRAW);
+        }
+    }
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+}
+
+void destroyFrameUpload(FrameUpload* upload)
+{
+    outputPPM = frameBuffer;
+    if (upload->mode == UPLOAD_CLIENT_MEMORY)
+        return;
+
+    for (uint32_t bufferIdx = 0; bufferIdx < NUM_UPLOAD_BUFFERS; ++bufferIdx)
+    {
+        if (upload->fences[bufferIdx])
+            glDeleteSync(upload->fences[bufferIdx]);
 
-                vec2* lineStart = map->vertices + lines[line];
-                vec2* lineEnd = map->vertices + lines[line + 1];
+        if (upload->mappings[bufferIdx])
+        {
+            glBindBuffer(GL_PIXEL_UNPACK_BUFFER, upload->buffers[bufferIdx]);
+            glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+        }
+    }
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+    glDeleteBuffers(NUM_UPLOAD_BUFFERS, upload->buffers);
+}
 
-                float raySin = sinf(rayAngle);
-                float rayCos = cosf(rayAngle);
+// points outputPPM at the memory the next frame should be rendered into
+void beginFrameUpload(FrameUpload* upload)
+{
+    uint32_t bufferIdx = upload->currentBuffer;
 
-                float playerSin = sinf(RAD(player->angle));
-                float playerCos = cosf(RAD(player->angle));
+    switch (upload->mode)
+    {
+    case UPLOAD_CLIENT_MEMORY:
+        outputPPM = frameBuffer;
+        break;
+
+    case UPLOAD_MAPPED_PBO:
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, upload->buffers[bufferIdx]);
+        outputPPM = (uint32_t*)glMapBufferRange(
+        GL_PIXEL_UNPACK_BUFFER, 0, upload->bufferSize, GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT);
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+
+        if (outputPPM == nullptr)
+            outputPPM = frameBuffer; // mapping failed, endFrameUpload falls back to client memory
+        break;
+
+    case UPLOAD_PERSISTENT_PBO:
+        // the GPU might still be copying out of this buffer from NUM_UPLOAD_BUFFERS frames ago
+        if (upload->fences[bufferIdx])
+        {
+            glClientWaitSync(upload->fences[bufferIdx], GL_SYNC_FLUSH_COMMANDS_BIT, GL_TIMEOUT_IGNORED);
+            glDeleteSync(upload->fences[bufferIdx]);
+            upload->fences[bufferIdx] = nullptr;
+        }
+        outputPPM = upload->mappings[bufferIdx];
 
-                vec2& rayStart = player->pos;
-                vec2 rayEnd{ rayStart.x + (player->viewDistance * rayCos),
-                             rayStart.y + (player->viewDistance * raySin) };
+        if (outputPPM == nullptr)
+            outputPPM = frameBuffer;
+        break;
+    }
+}
 
-                vec2 r = { rayEnd.x - rayStart.x, rayEnd.y - rayStart.y };
-                vec2 s = { lineEnd->x - lineStart->x, lineEnd->y - lineStart->y };
+// copies the rendered frame into the bound texture, from a pixel buffer the copy runs asynchronously
+// only the first numColumns rows of the texture are updated
+void endFrameUpload(FrameUpload* upload, uint16_t numColumns)
+{
+    uint32_t bufferIdx = upload->currentBuffer;
 
-                float SCrossR = cross(&s, &r);
-                float u = (cross(&rayStart, &r) - cross(lineStart, &r)) / SCrossR;
-                float t = -(cross(lineStart, &s) - cross(&rayStart, &s)) / SCrossR;
+    if (upload->mode == UPLOAD_CLIENT_MEMORY || outputPPM == frameBuffer)
+    {
+        glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, resolution.height, numColumns, GL_RGBA, GL_UNSIGNED_BYTE, frameBuffer);
+        return;
+    }
+
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, upload->buffers[bufferIdx]);
 
-                if (u < 0.f || u > 1.f || t < 0.f || t > 1.f)
-                    continue; // no intersection
+    if (upload->mode == UPLOAD_MAPPED_PBO)
+        glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
 
-                vec2 intersectionPoint = { rayStart.x + (r.x * t), rayStart.y + (r.y * t) };
-                vec2 toIntersection = { intersectionPoint.x - rayStart.x,
-                                        intersectionPoint.y - rayStart.y };
+    glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, resolution.height, numColumns, GL_RGBA, GL_UNSIGNED_BYTE, (void*)0);
 
-                float distanceToWall = (toIntersection.x * playerCos) + (toIntersection.y * playerSin);
+    if (upload->mode == UPLOAD_PERSISTENT_PBO)
+        upload->fences[bufferIdx] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
 
-                int persp = (WALL_DIVIDE_CONST / distanceToWall) / 2;
-                int drawStart = (WINDOW_HEIGHT / 2) - persp;
-                int drawEnd = (WINDOW_HEIGHT / 2) + persp;
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+    upload->currentBuffer = (bufferIdx + 1) % NUM_UPLOAD_BUFFERS;
+}
+
+// keeps the render time around the budget by changing the number of columns, the height stays the same
+// so the quad pass has to stretch less or more horizontally, the width moves in steps of the kernel width
+void updateDynamicResolution(Resolution* res, float frameTime)
+{
+    if (res->frameBudget <= 0.f)
+        return;
 
-                drawEnd = drawEnd > WINDOW_HEIGHT ? WINDOW_HEIGHT : drawEnd;
-                drawStart = drawStart < 0 ? 0 : drawStart;
+    res->averageFrameTime =
+    res->averageFrameTime == 0.f ? frameTime : (res->averageFrameTime * 0.9f) + (frameTime * 0.1f);
 
-                for (uint32_t y = drawStart; y < drawEnd; ++y)
+    uint32_t width = res->width;
+    if (res->averageFrameTime > res->frameBudget)
+        width = (uint32_t)(width * 0.9f);
+    else if (res->averageFrameTime < res->frameBudget * 0.8f)
+        width = (uint32_t)(width * 1.05f) + MAX_KERNEL_WIDTH;
+
+    uint32_t minWidth = res->maxWidth / 4;
+    minWidth = minWidth < MAX_KERNEL_WIDTH ? MAX_KERNEL_WIDTH : minWidth;
+
+    width -= width % MAX_KERNEL_WIDTH;
+    width = width < minWidth ? minWidth : width;
+    width = width > res->maxWidth ? res->maxWidth : width;
+
+    if (width == res->width)
+        return;
+
+    // the render time is roughly linear in the number of columns, so rescale the average
+    // instead of waiting for it to catch up, otherwise the width would keep overshooting
+    res->averageFrameTime *= ((float)width) / res->width;
+    res->width = (uint16_t)width;
+}
+
+uint32_t* frameColumn(uint16_t x) { return outputPPM + ((size_t)x * resolution.height); }
+
+void initRenderPool(RenderPool* pool, uint32_t numThreads)
+{
+    // workers start waiting for frame 1, so the counter has to restart with every pool
+    pool->numThreads = numThreads;
+    pool->isShuttingDown = false;
+    pool->frameIdx = 0;
+    pool->clips = new ColumnClip[numThreads];
+    pool->workers = new std::thread[numThreads - 1];
+
+    for (uint32_t stripIdx = 1; stripIdx < numThreads; ++stripIdx)
+        pool->workers[stripIdx - 1] = std::thread(renderPoolWorker, pool, stripIdx);
+}
+
+void destroyRenderPool(RenderPool* pool)
+{
+    {
+        std::lock_guard<std::mutex> lock(pool->mutex);
+        pool->isShuttingDown = true;
+    }
+    pool->frameStarted.notify_all();
+
+    for (uint32_t workerIdx = 0; workerIdx < pool->numThreads - 1; ++workerIdx)
+        pool->workers[workerIdx].join();
+
+    delete[] pool->workers;
+    delete[] pool->clips;
+    pool->workers = nullptr;
+    pool->clips = nullptr;
+    pool->numThreads = 0;
+}
+
+void renderPoolWorker(RenderPool* pool, uint32_t stripIdx)
+{
+    uint64_t lastFrameIdx = 0;
+    for (;;)
+    {
+        {
+            std::unique_lock<std::mutex> lock(pool->mutex);
+            pool->frameStarted.wait(
+            lock, [pool, lastFrameIdx] { return pool->isShuttingDown || pool->frameIdx != lastFrameIdx; });
+
+            if (pool->isShuttingDown)
+                return;
+
+            lastFrameIdx = pool->frameIdx;
+        }
+
+        renderStrip(pool, stripIdx);
+
+        bool isLastStrip;
+        {
+            std::lock_guard<std::mutex> lock(pool->mutex);
+            isLastStrip = --pool->numPendingStrips == 0;
+        }
+
+        if (isLastStrip)
+            pool->frameFinished.notify_one();
+    }
+}
+
+// clears and renders the columns of one strip, outputPPM is indexed by column first so the strip is one block
+void renderStrip(RenderPool* pool, uint32_t stripIdx)
+{
+    uint16_t numColumns = pool->rays->numColumns;
+    uint32_t stripStart = (numColumns * stripIdx) / pool->numThreads;
+    uint32_t stripEnd = (numColumns * (stripIdx + 1)) / pool->numThreads;
+
+    if (stripStart == stripEnd)
+        return; // more threads than columns after the dynamic resolution went down
+
+    memset(frameColumn(stripStart), 0, sizeof(uint32_t) * resolution.height * (stripEnd - stripStart));
+
+    ColumnClip* clip = pool->clips + stripIdx;
+    resetColumnClip(clip, (uint16_t)stripStart, (uint16_t)(stripEnd - 1), numColumns);
+    render(pool->map, 0, pool->player, pool->rays, clip);
+}
+
+void buildRayTable(RayTable* rays, Player* player, Resolution* res)
+{
+    float numColumns = (float)res->width;
+
+    // WALL_DIVIDE_CONST was tuned for the 800 rows of the window
+    rays->numColumns = res->width;
+    rays->numRows = res->height;
+    rays->wallScale = WALL_DIVIDE_CONST * (res->height / WINDOW_HEIGHT_F);
+
+    float playerAngle = RAD(player->angle);
+    rays->forward = { cosf(playerAngle), sinf(playerAngle) };
+
+    rays->halfFov = RAD(player->fov / 2);
+    rays->columnsPerRadian = numColumns / RAD(player->fov);
+    rays->leftEdge = { cosf(playerAngle + rays->halfFov), sinf(playerAngle + rays->halfFov) };
+    rays->rightEdge = { cosf(playerAngle - rays->halfFov), sinf(playerAngle - rays->halfFov) };
+
+    for (uint32_t x = 0; x < res->width; ++x)
+    {
+        float progress = ((float)x) / numColumns;
+        float degrees = player->angle + (player->fov / 2) - (progress * player->fov);
+        float rayAngle = RAD(degrees);
+
+        rays->rayX[x] = player->viewDistance * cosf(rayAngle);
+        rays->rayY[x] = player->viewDistance * sinf(rayAngle);
+
+        rays->rayDepths[x] = (rays->rayX[x] * rays->forward.x) + (rays->rayY[x] * rays->forward.y);
+    }
+}
+
+// renders the scripted camera path without touching SDL/GL, so it can run on machines without a GPU
+// prints the timings in a stable, greppable format and dumps the last frame as a PPM
+// with scaling the path is rendered with 1, 2, 4... threads up to numThreads, one block of timings each
+int runBenchmark(Map* map, Player* player, uint32_t numFrames, uint32_t numThreads, bool scaling,
+                 const char* outputPath)
+{
+    if (numFrames == 0)
+    {
+        puts(manual);
+        return 1;
+    }
+
+    static const uint32_t percentiles[] = { 50, 90, 95, 99 };
+    double* frameTimes = new double[numFrames];
+
+    printf("frames: %u\n", numFrames);
+    printf("resolution: %ux%u\n", resolution.maxWidth, resolution.height);
+    printf("frame_budget_ms: %.3f\n", resolution.frameBudget);
+    printf("kernel: %s\n", intersectKernel.name);
+
+    uint32_t threadCount = scaling ? 1 : numThreads;
+    for (;;)
+    {
+        resolution.width = resolution.maxWidth;
+        resolution.averageFrameTime = 0.f;
+        initRenderPool(&renderPool, threadCount);
+
+        typedef std::chrono::high_resolution_clock Clock;
+        Clock::time_point benchmarkStart = Clock::now();
+        benchmarkCameraPath(map, player, numFrames, frameTimes);
+        double totalTime = std::chrono::duration<double, std::milli>(Clock::now() - benchmarkStart).count();
+
+        destroyRenderPool(&renderPool);
+
+        std::sort(frameTimes, frameTimes + numFrames);
+
+        printf("threads: %u\n", threadCount);
+        printf("total_ms: %.3f\n", totalTime);
+        printf("fps: %.2f\n", (numFrames * 1000.0) / totalTime);
+        printf("min_ms: %.3f\n", frameTimes[0]);
+        for (uint32_t percentile : percentiles)
+        {
+            uint32_t rank = (uint32_t)ceil((percentile / 100.0) * numFrames);
+            printf("p%u_ms: %.3f\n", percentile, frameTimes[rank > 0 ? rank - 1 : 0]);
+        }
+        printf("max_ms: %.3f\n", frameTimes[numFrames - 1]);
+        printf("final_width: %u\n", resolution.width);
+
+        if (threadCount == numThreads)
+            break;
+
+        threadCount = threadCount * 2 > numThreads ? numThreads : threadCount * 2;
+    }
+
+    delete[] frameTimes;
+
+    return writePPM(outputPath) ? 0 : 1;
+}
+
+void benchmarkCameraPath(Map* map, Player* player, uint32_t numFrames, double* frameTimes)
+{
+    typedef std::chrono::high_resolution_clock Clock;
+    static const uint32_t numKeys = sizeof(benchmarkPath) / sizeof(CameraKey);
+
+    for (uint32_t frameIdx = 0; frameIdx < numFrames; ++frameIdx)
+    {
+        float pathProgress = (((float)frameIdx) / numFrames) * (numKeys - 1);
+        uint32_t keyIdx = (uint32_t)pathProgress;
+        float keyProgress = pathProgress - keyIdx;
+
+        CameraKey* from = benchmarkPath + keyIdx;
+        CameraKey* to = benchmarkPath + keyIdx + 1;
+
+        player->pos.x = from->pos.x + ((to->pos.x - from->pos.x) * keyProgress);
+        player->pos.y = from->pos.y + ((to->pos.y - from->pos.y) * keyProgress);
+        player->angle = from->angle + ((to->angle - from->angle) * keyProgress);
+
+        if (frameIdx > 0)
+            updateDynamicResolution(&resolution, (float)frameTimes[frameIdx - 1]);
+
+        Clock::time_point frameStart = Clock::now();
+        renderFrame(map, player);
+        frameTimes[frameIdx] = std::chrono::duration<double, std::milli>(Clock::now() - frameStart).count();
+    }
+}
+
+// outputPPM is stored column after column with row 0 at the top of the screen
+// writes the columns of the last frame, so with the dynamic resolution the image can be narrower
+bool writePPM(const char* outputPath)
+{
+    FILE* ppmFile = fopen(outputPath, "wb");
+    if (ppmFile == nullptr)
+    {
+        printf("Failed to open %s for writing\n", outputPath);
+        return false;
+    }
+
+    fprintf(ppmFile, "P6\n%u %u\n255\n", resolution.width, resolution.height);
+
+    uint8_t* row = new uint8_t[resolution.width * 3];
+    for (uint32_t y = 0; y < resolution.height; ++y)
+    {
+        for (uint16_t x = 0; x < resolution.width; ++x)
+        {
+            uint32_t pixel = frameColumn(x)[y];
+            row[(x * 3) + 0] = (uint8_t)(pixel);
+            row[(x * 3) + 1] = (uint8_t)(pixel >> 8);
+            row[(x * 3) + 2] = (uint8_t)(pixel >> 16);
+        }
+        fwrite(row, resolution.width * 3, 1, ppmFile);
+    }
+
+    delete[] row;
+    fclose(ppmFile);
+    return true;
+}
+
+// only the columns of the strip start open, everything else is linked past it
+void resetColumnClip(ColumnClip* clip, uint16_t firstColumn, uint16_t lastColumn, uint16_t numColumns)
+{
+    clip->numColumns = numColumns;
+    clip->numOpenColumns = lastColumn - firstColumn + 1;
+    clip->numHitColumns = 0;
+    for (uint16_t x = 0; x <= numColumns; ++x)
+    {
+        if (x < numColumns)
+            clip->nearestT[x] = NO_HIT;
+
+        if (x < firstColumn)
+            clip->nextOpen[x] = firstColumn;
+        else if (x > lastColumn)
+            clip->nextOpen[x] = numColumns;
+        else
+            clip->nextOpen[x] = x;
+    }
+}
+
+// closed columns point further to the right, the links are shortened on the way (path halving)
+// so skipping a run of finished columns stays cheap even when the screen is almost full
+uint16_t nextOpenColumn(ColumnClip* clip, uint16_t x)
+{
+    while (clip->nextOpen[x] != x)
+    {
+        clip->nextOpen[x] = clip->nextOpen[clip->nextOpen[x]];
+        x = clip->nextOpen[x];
+    }
+    return x;
+}
+
+void closeColumn(ColumnClip* clip, uint16_t x)
+{
+    clip->nextOpen[x] = x + 1;
+    --clip->numOpenColumns;
+}
+
+// picks the widest kernel the CPU supports, or the one asked for by name
+bool pickIntersectKernel(IntersectKernel* kernel, const char* name)
+{
+    static IntersectKernel kernels[] = {
+#ifdef BSP_X86
+        { "avx", 8, intersectAVX },
+        { "sse", 4, intersectSSE },
+#endif
+        { "scalar", 1, intersectScalar },
+    };
+
+    for (IntersectKernel& candidate : kernels)
+    {
+        if (name != nullptr && strcmp(name, candidate.name) != 0)
+            continue;
+
+#ifdef BSP_X86
+        if (candidate.intersect == intersectAVX && !isAVXSupported())
+            continue;
+#endif
+
+        *kernel = candidate;
+        return true;
+    }
+    return false;
+}
+
+// a ray misses when u or t fall outside of [0, 1], written so that NaNs (ray parallel to the wall) miss as well
+uint32_t intersectScalar(RayTable* rays, uint16_t x, vec2* s, vec2* toRayStart, float* t)
+{
+    vec2 r = { rays->rayX[x], rays->rayY[x] };
+
+    float SCrossR = cross(s, &r);
+    float u = cross(toRayStart, &r) / SCrossR;
+    t[0] = cross(toRayStart, s) / SCrossR;
+
+    return u >= 0.f && u <= 1.f && t[0] >= 0.f && t[0] <= 1.f;
+}
+
+#ifdef BSP_X86
+uint32_t intersectSSE(RayTable* rays, uint16_t x, vec2* s, vec2* toRayStart, float* t)
+{
+    __m128 rayX = _mm_loadu_ps(rays->rayX + x);
+    __m128 rayY = _mm_loadu_ps(rays->rayY + x);
+
+    __m128 sX = _mm_set1_ps(s->x);
+    __m128 sY = _mm_set1_ps(s->y);
+    __m128 toRayStartX = _mm_set1_ps(toRayStart->x);
+    __m128 toRayStartY = _mm_set1_ps(toRayStart->y);
+
+    __m128 SCrossR = _mm_sub_ps(_mm_mul_ps(sX, rayY), _mm_mul_ps(rayX, sY));
+    __m128 u = _mm_div_ps(_mm_sub_ps(_mm_mul_ps(toRayStartX, rayY), _mm_mul_ps(rayX, toRayStartY)), SCrossR);
+    __m128 rayT = _mm_div_ps(_mm_set1_ps(cross(toRayStart, s)), SCrossR);
+
+    __m128 zero = _mm_setzero_ps();
+    __m128 one = _mm_set1_ps(1.f);
+    __m128 hits = _mm_and_ps(_mm_and_ps(_mm_cmpge_ps(u, zero), _mm_cmple_ps(u, one)),
+                             _mm_and_ps(_mm_cmpge_ps(rayT, zero), _mm_cmple_ps(rayT, one)));
+
+    _mm_storeu_ps(t, rayT);
+    return (uint32_t)_mm_movemask_ps(hits);
+}
+
+BSP_TARGET_AVX uint32_t intersectAVX(RayTable* rays, uint16_t x, vec2* s, vec2* toRayStart, float* t)
+{
+    __m256 rayX = _mm256_loadu_ps(rays->rayX + x);
+    __m256 rayY = _mm256_loadu_ps(rays->rayY + x);
+
+    __m256 sX = _mm256_set1_ps(s->x);
+    __m256 sY = _mm256_set1_ps(s->y);
+    __m256 toRayStartX = _mm256_set1_ps(toRayStart->x);
+    __m256 toRayStartY = _mm256_set1_ps(toRayStart->y);
+
+    __m256 SCrossR = _mm256_sub_ps(_mm256_mul_ps(sX, rayY), _mm256_mul_ps(rayX, sY));
+    __m256 u =
+    _mm256_div_ps(_mm256_sub_ps(_mm256_mul_ps(toRayStartX, rayY), _mm256_mul_ps(rayX, toRayStartY)), SCrossR);
+    __m256 rayT = _mm256_div_ps(_mm256_set1_ps(cross(toRayStart, s)), SCrossR);
+
+    __m256 zero = _mm256_setzero_ps();
+    __m256 one = _mm256_set1_ps(1.f);
+    __m256 hits = _mm256_and_ps(_mm256_and_ps(_mm256_cmp_ps(u, zero, _CMP_GE_OQ), _mm256_cmp_ps(u, one, _CMP_LE_OQ)),
+                                _mm256_and_ps(_mm256_cmp_ps(rayT, zero, _CMP_GE_OQ),
+                                              _mm256_cmp_ps(rayT, one, _CMP_LE_OQ)));
+
+    _mm256_storeu_ps(t, rayT);
+    return (uint32_t)_mm256_movemask_ps(hits);
+}
+
+// the CPU has to report AVX and the OS has to save the ymm registers (OSXSAVE + XCR0)
+bool isAVXSupported()
+{
+#if defined(_MSC_VER)
+    int cpuInfo[4];
+    __cpuid(cpuInfo, 1);
+
+    bool hasAVX = (cpuInfo[2] & (1 << 28)) != 0;
+    bool hasOSXSave = (cpuInfo[2] & (1 << 27)) != 0;
+    return hasAVX && hasOSXSave && ((_xgetbv(0) & 0x6) == 0x6);
+#else
+    return __builtin_cpu_supports("avx");
+#endif
+}
+#endif
+
+inline uint32_t lowestSetBit(uint32_t mask)
+{
+#if defined(_MSC_VER)
+    unsigned long bitIdx;
+    _BitScanForward(&bitIdx, mask);
+    return bitIdx;
+#else
+    return __builtin_ctz(mask);
+#endif
+}
+
+// projects the wall onto the screen and returns the (conservative) range of columns it can cover
+// walls out of the rays' reach, behind the player or fully outside of one of the frustum edges are rejected up front
+bool segmentColumnRange(BSPWall* wall, Player* player, RayTable* rays, uint16_t* firstColumn, uint16_t* lastColumn)
+{
+    // the line equation gives the player's distance to the whole line, the length bounds the distance to the
+    // middle of the wall, both are cheaper than projecting the ends
+    float lineDistance = (wall->normal.x * player->pos.x) + (wall->normal.y * player->pos.y) - wall->distance;
+    if (fabsf(lineDistance) > player->viewDistance)
+        return false;
+
+    vec2 a = { wall->start.x - player->pos.x, wall->start.y - player->pos.y };
+    vec2 b = { a.x + wall->direction.x, a.y + wall->direction.y };
+
+    vec2 toMiddle = { a.x + (wall->direction.x * 0.5f), a.y + (wall->direction.y * 0.5f) };
+    float reach = player->viewDistance + (wall->length * 0.5f);
+    if ((toMiddle.x * toMiddle.x) + (toMiddle.y * toMiddle.y) > reach * reach)
+        return false;
+
+    if (cross(&rays->leftEdge, &a) > 0.f && cross(&rays->leftEdge, &b) > 0.f)
+        return false;
+
+    if (cross(&rays->rightEdge, &a) < 0.f && cross(&rays->rightEdge, &b) < 0.f)
+        return false;
+
+    float depthA = (a.x * rays->forward.x) + (a.y * rays->forward.y);
+    float depthB = (b.x * rays->forward.x) + (b.y * rays->forward.y);
+
+    if (depthA < NEAR_DEPTH && depthB < NEAR_DEPTH)
+        return false;
+
+    // clip the part behind the player, so both ends project onto the same half of the view
+    if (depthA < NEAR_DEPTH)
+    {
+        float clipT = (NEAR_DEPTH - depthA) / (depthB - depthA);
+        a = { a.x + ((b.x - a.x) * clipT), a.y + ((b.y - a.y) * clipT) };
+        depthA = NEAR_DEPTH;
+    }
+    else if (depthB < NEAR_DEPTH)
+    {
+        float clipT = (NEAR_DEPTH - depthB) / (depthA - depthB);
+        b = { b.x + ((a.x - b.x) * clipT), b.y + ((a.y - b.y) * clipT) };
+        depthB = NEAR_DEPTH;
+    }
+
+    // columns go from the left edge of the view to the right one, so larger angles map to smaller columns
+    float columnA = (rays->halfFov - atan2f(cross(&rays->forward, &a), depthA)) * rays->columnsPerRadian;
+    float columnB = (rays->halfFov - atan2f(cross(&rays->forward, &b), depthB)) * rays->columnsPerRadian;
+
+    float minColumn = columnA < columnB ? columnA : columnB;
+    float maxColumn = columnA < columnB ? columnB : columnA;
+
+    float numColumns = (float)rays->numColumns;
+    if (maxColumn < 0.f || minColumn > numColumns - 1.f)
+        return false;
+
+    // one column of slack on each side covers the rounding of the projection
+    *firstColumn = minColumn < 1.f ? 0 : (uint16_t)(minColumn - 1.f);
+    *lastColumn = maxColumn > numColumns - 2.f ? rays->numColumns - 1 : (uint16_t)(maxColumn + 1.f);
+    return true;
+}
+
+// a subtree can't contribute any pixel if its bounds are fully outside one of the frustum edges,
+// fully behind the player or further away than the rays reach
+bool isBoundsVisible(BSPBounds* bounds, Player* player, RayTable* rays)
+{
+    vec2 corners[4] = {
+        { bounds->min.x - player->pos.x, bounds->min.y - player->pos.y },
+        { bounds->max.x - player->pos.x, bounds->min.y - player->pos.y },
+        { bounds->max.x - player->pos.x, bounds->max.y - player->pos.y },
+        { bounds->min.x - player->pos.x, bounds->max.y - player->pos.y },
+    };
+
+    bool outsideLeft = true, outsideRight = true, behind = true;
+    for (uint32_t cornerIdx = 0; cornerIdx < 4; ++cornerIdx)
+    {
+        vec2* corner = corners + cornerIdx;
+        outsideLeft &= cross(&rays->leftEdge, corner) > 0.f;
+        outsideRight &= cross(&rays->rightEdge, corner) < 0.f;
+        behind &= ((corner->x * rays->forward.x) + (corner->y * rays->forward.y)) < NEAR_DEPTH;
+    }
+
+    if (outsideLeft || outsideRight || behind)
+        return false;
+
+    // distance from the player to the closest point of the box
+    float dx = fmaxf(fmaxf(bounds->min.x - player->pos.x, 0.f), player->pos.x - bounds->max.x);
+    float dy = fmaxf(fmaxf(bounds->min.y - player->pos.y, 0.f), player->pos.y - bounds->max.y);
+
+    return ((dx * dx) + (dy * dy)) <= (player->viewDistance * player->viewDistance);
+}
+
+bool render(Map* map, uint32_t nodeIdx, Player* player, RayTable* rays, ColumnClip* clip)
+{
+    if (!isBoundsVisible(map->bounds + nodeIdx, player, rays))
+        return true; // nothing to draw here, but the rest of the tree still has to be visited
+
+    BSPNode* node = map->nodes + nodeIdx;
+    if (node->children & BSP_LEAF_NODE)
+    {
+        uint32_t leafIdx = node->children & ~BSP_LEAF_NODE;
+        BSPLeaf* leaf = map->leaves + leafIdx;
+        BSPWall* walls = map->walls + (leaf->firstIndex / 2);
+        uint32_t wallColor = packColor(map->colors + leafIdx);
+        vec2& rayStart = player->pos;
+
+        for (uint32_t wallIdx = 0; wallIdx < leaf->numIndices / 2 && clip->numOpenColumns > 0; ++wallIdx)
+        {
+            BSPWall* wall = walls + wallIdx;
+
+            uint16_t firstColumn, lastColumn;
+            if (!segmentColumnRange(wall, player, rays, &firstColumn, &lastColumn))
+                continue;
+
+            vec2 s = wall->direction;
+            vec2 toRayStart = { rayStart.x - wall->start.x, rayStart.y - wall->start.y };
+
+            // batches past the wall's range jump straight to the sentinel
+            uint32_t width = intersectKernel.width;
+            for (uint16_t x = nextOpenColumn(clip, firstColumn); x <= lastColumn;
+                 x = nextOpenColumn(clip, x + width > lastColumn ? clip->numColumns : x + width))
+            {
+                float t[MAX_KERNEL_WIDTH];
+                uint32_t hits = intersectKernel.intersect(rays, x, &s, &toRayStart, t);
+
+                // drop the lanes past the wall's range, the kernel always tests a full batch
+                uint32_t numLanes = lastColumn - x + 1;
+                hits &= numLanes < 32 ? (1u << numLanes) - 1 : ~0u;
+
+                while (hits)
                 {
-                    if (outputPPM[x][y].x > 0)
-                        continue; // TODO cheap trick not to overdraw, think about it
-                    outputPPM[x][y] = node->data.lines.wallColor;
+                    uint32_t lane = lowestSetBit(hits);
+                    hits &= hits - 1;
+
+                    uint16_t column = x + lane;
+                    if (clip->nextOpen[column] != column)
+                        continue; // already covered by a wall of a closer leaf
+
+                    if (clip->nearestT[column] == NO_HIT)
+                        clip->hitColumns[clip->numHitColumns++] = column;
+
+                    clip->nearestT[column] = t[lane] < clip->nearestT[column] ? t[lane] : clip->nearestT[column];
                 }
-                break;
             }
             // TODO RENDER BACK
         }
-        return true;
-    }
 
-    uint32_t* splitter = node->data.children.splitter;
+        for (uint16_t hitIdx = 0; hitIdx < clip->numHitColumns; ++hitIdx)
+        {
+            uint16_t column = clip->hitColumns[hitIdx];
+
+            // t scales the ray, so the perpendicular distance is just the scaled ray depth
+            float distanceToWall = clip->nearestT[column] * rays->rayDepths[column];
+            clip->nearestT[column] = NO_HIT;
+
+            int persp = (rays->wallScale / distanceToWall) / 2;
+            int drawStart = (rays->numRows / 2) - persp;
+            int drawEnd = (rays->numRows / 2) + persp;
 
-    BSPNode* front = FRONT_CHILD(node);
-    BSPNode* back = BACK_CHILD(node);
+            drawEnd = drawEnd > rays->numRows ? rays->numRows : drawEnd;
+            drawStart = drawStart < 0 ? 0 : drawStart;
 
-    if (!isPointInFront(map, splitter, &player->pos))
+            uint32_t* span = frameColumn(column);
+            for (int32_t y = drawStart; y < drawEnd; ++y)
+                span[y] = wallColor;
+
+            closeColumn(clip, column);
+        }
+        clip->numHitColumns = 0;
+
+        // once every column has its wall there is nothing left to draw, stop the whole traversal
+        return clip->numOpenColumns > 0;
+    }
+
+    uint32_t front = node->children;
+    uint32_t back = node->children + 1;
+
+    bool isPlayerInFront = (node->normal.x * player->pos.x) + (node->normal.y * player->pos.y) > node->distance;
+    if (!isPlayerInFront)
     {
-        BSPNode* tmp = front;
+        uint32_t tmp = front;
         front = back;
         back = tmp;
     }
 
-    if (render(map, front, player))
-    {
-        render(map, back, player);
-        return true;
-    }
+    if (render(map, front, player, rays, clip))
+        return render(map, back, player, rays, clip);
 
     return false;
 }
 
-// checking which side are we on, using the 2D cross product
-// if cross(v, u) > 0 it means that we're in front of the line and < 0 mean we're behind
-bool isPointInFront(Map* map, uint32_t* lineIndices, vec2* point)
+// byte order R, G, B, A in memory, matching GL_RGBA + GL_UNSIGNED_BYTE on a little endian CPU
+uint32_t packColor(vec3* color)
 {
-    vec2* lineStart = map->vertices + lineIndices[0];
-    vec2* lineEnd = map->vertices + lineIndices[1];
-
-    vec2 pointVec{ point->x - lineStart->x, point->y - lineStart->y };
-    vec2 lineVec{ lineEnd->x - lineStart->x, lineEnd->y - lineStart->y };
-
-    return lineVec.x * pointVec.y > lineVec.y * pointVec.x;
+    uint32_t r = (uint8_t)(color->x * 255.f);
+    uint32_t g = (uint8_t)(color->y * 255.f);
+    uint32_t b = (uint8_t)(color->z * 255.f);
+    return r | (g << 8) | (b << 16) | (0xFFu << 24);
 }
 
 float cross(vec2* a, vec2* b) { return (a->x * b->y) - (b->x * a->y); }
\ No newline at end of file
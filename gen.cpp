@@ -13,21 +13,35 @@ static vec2 mapVertices[400] = { { 100.f, 100.f }, { 700.f, 100.f }, { 700.f, 50
 
 static uint32_t mapIndices[]{ 0, 1, 1, 2, 2, 3, 3, 0, 4, 5, 5, 6, 6, 7, 7, 4, 8, 9, 9, 10, 10, 11, 11, 8 };
 
+// regression map, the second line ends 0.0005 past the first one, closer than the default weld epsilon, so the
+// cut welds onto its own end, which used to give the builder the same lines back forever, with and without --exact
+static vec2 touchingVertices[] = { { 0.f, 0.f }, { 10.f, 0.f }, { 5.f, -5.f }, { 5.f, 0.0005f } };
+
+static uint32_t touchingIndices[]{ 0, 1, 2, 3 };
+
 struct MapFileHeader
 {
     uint32_t numVertices;
     uint32_t numOfIndices;
 };
 
-int main()
+void writeMap(const char* path, vec2* vertices, uint32_t numVertices, uint32_t* indices, uint32_t numIndices)
 {
     MapFileHeader mapFileHeader;
-    mapFileHeader.numVertices = sizeof(mapVertices) / sizeof(vec2);
-    mapFileHeader.numOfIndices = sizeof(mapIndices) / sizeof(uint32_t);
-    FILE* mapFile = fopen("test.map", "wb");
+    mapFileHeader.numVertices = numVertices;
+    mapFileHeader.numOfIndices = numIndices;
+    FILE* mapFile = fopen(path, "wb");
     fwrite(&mapFileHeader, sizeof(MapFileHeader), 1, mapFile);
-    fwrite(mapVertices, sizeof(vec2), mapFileHeader.numVertices, mapFile);
-    fwrite(mapIndices, sizeof(uint32_t), mapFileHeader.numOfIndices, mapFile);
+    fwrite(vertices, sizeof(vec2), mapFileHeader.numVertices, mapFile);
+    fwrite(indices, sizeof(uint32_t), mapFileHeader.numOfIndices, mapFile);
     fclose(mapFile);
+}
+
+int main()
+{
+    writeMap("test.map", mapVertices, sizeof(mapVertices) / sizeof(vec2), mapIndices,
+             sizeof(mapIndices) / sizeof(uint32_t));
+    writeMap("touching.map", touchingVertices, sizeof(touchingVertices) / sizeof(vec2), touchingIndices,
+             sizeof(touchingIndices) / sizeof(uint32_t));
     return 0;
 }
\ No newline at end of file